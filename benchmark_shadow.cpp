@@ -0,0 +1,319 @@
+//
+// 古典シャドウのライブラリ (shadow.h) のベンチマーク
+//
+// 合成したワークロード (ランダムなショット、generate_observables.cpp と同じ形の
+// k 局所観測量、部分系のリスト) をメモリ上に作り、以下を計測します:
+//   predict_observables : prediction_shadow -o (observable_predictor)
+//   predict_entropies   : prediction_shadow -e (renyi_predictor, auto)
+//   predict_correlations: prediction_shadow -c (correlation_predictor)
+//   randomized_scheme   : data_acquisition_shadow -r (random_bases)
+//   derandomized_scheme : data_acquisition_shadow -d (scheme_generator)
+// 結果は JSON として標準出力 (または --output のファイル) に書き出されます。
+//
+#include "shadow.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+using namespace std;
+using namespace shadow;
+
+long long number_of_shots = 20000;     // --shots N
+int number_of_observables = 20000;     // --observables N
+int number_of_scheme_rows = 20;        // --rows N
+vector<int> system_sizes;              // --sizes 10,100,1000
+vector<int> thread_counts;             // --threads 1,2,4
+const char *output_file_name = NULL;   // --output [bench.json]
+
+//
+// ワークロードを再現できるように、乱数は固定のシードの xorshift で作ります。
+//
+uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+uint64_t next_random() {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+//
+// 以下の関数は一様ランダムなパウリ基底と測定結果を持つショットを
+// number_of_shots 個作ります。
+//
+vector<uint64_t> random_shots(int system_size, long long number_of_shots) {
+  int stride = shot_stride(system_size);
+  vector<uint64_t> shots((size_t)stride * number_of_shots, 0);
+  for (long long t = 0; t < number_of_shots; t++) {
+    uint64_t *shot = &shots[t * stride];
+    for (int ith_qubit = 0; ith_qubit < system_size; ith_qubit++) {
+      uint64_t random = next_random();
+      int pauli = (int)(random % 3);
+      uint64_t *word = shot + 3 * (ith_qubit >> 6);
+      uint64_t bit = 1ULL << (ith_qubit & 63);
+      if (pauli & 1)
+        word[0] |= bit;
+      if (pauli & 2)
+        word[1] |= bit;
+      if ((random >> 32) & 1)
+        word[2] |= bit;
+    }
+  }
+  return shots;
+}
+
+//
+// 以下の関数は generate_observables.cpp と同じ形の観測量
+//   4 Y i Y i+1 X j X j+1,  4 X i X i+1 Z j Z j2,  3 X i X i+1 Z j
+// をランダムな位置に number_of_observables 個作ります。
+//
+observable_set random_observables(int system_size, int number_of_observables) {
+  observable_set observables(system_size);
+  vector<pair<int, int>> factors;
+  const int X = 0, Y = 1, Z = 2;
+  while (observables.size() < number_of_observables) {
+    int i = (int)(next_random() % (system_size - 1));
+    int j = (int)(next_random() % (system_size - 1));
+    int j2 = (int)(next_random() % system_size);
+    int family = (int)(next_random() % 3);
+    factors.clear();
+    if (family == 0) {
+      if (j == i || j == i + 1 || j + 1 == i)
+        continue;
+      factors.push_back(make_pair(i, Y));
+      factors.push_back(make_pair(i + 1, Y));
+      factors.push_back(make_pair(j, X));
+      factors.push_back(make_pair(j + 1, X));
+    } else if (family == 1) {
+      if (j == i || j == i + 1 || j2 == i || j2 == i + 1 || j2 == j)
+        continue;
+      factors.push_back(make_pair(i, X));
+      factors.push_back(make_pair(i + 1, X));
+      factors.push_back(make_pair(j, Z));
+      factors.push_back(make_pair(j2, Z));
+    } else {
+      if (j == i || j == i + 1)
+        continue;
+      factors.push_back(make_pair(i, X));
+      factors.push_back(make_pair(i + 1, X));
+      factors.push_back(make_pair(j, Z));
+    }
+    observables.add(factors);
+  }
+  return observables;
+}
+
+//
+// 以下の関数は連続した量子ビットからなる大きさ 1, 2, 4, 8 の部分系を、
+// それぞれ最大 16 個作ります。
+//
+vector<vector<int>> block_subsystems(int system_size) {
+  vector<vector<int>> subsystems;
+  for (int size = 1; size <= 8 && size <= system_size; size *= 2) {
+    int number_of_blocks = min(16, system_size / size);
+    for (int block = 0; block < number_of_blocks; block++) {
+      vector<int> subsystem;
+      for (int i = 0; i < size; i++)
+        subsystem.push_back(block * size + i);
+      subsystems.push_back(subsystem);
+    }
+  }
+  return subsystems;
+}
+
+//
+// 計測とその結果の出力
+//
+double seconds_since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+long peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+vector<string> results;
+
+void report(const char *workload, int system_size, int threads,
+            long long shots, long long observables, long long rows,
+            double wall_seconds, double cpu_seconds) {
+  char line[1024];
+  snprintf(line, sizeof(line),
+           "    {\"workload\": \"%s\", \"system_size\": %d, \"threads\": %d, "
+           "\"shots\": %lld, \"observables\": %lld, \"rows\": %lld, "
+           "\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, "
+           "\"shots_per_second\": %.1f, \"observables_per_second\": %.1f, "
+           "\"rows_per_second\": %.1f, \"peak_rss_kb\": %ld}",
+           workload, system_size, threads, shots, observables, rows,
+           wall_seconds, cpu_seconds, shots / wall_seconds,
+           observables / wall_seconds, rows / wall_seconds, peak_rss_kb());
+  results.push_back(line);
+  fprintf(stderr, "[%s n=%d threads=%d] %.3f s\n", workload, system_size,
+          threads, wall_seconds);
+}
+
+//
+// 以下のマクロは body を実行し、経過時間 (wall) と CPU 時間を計測します。
+//
+#define MEASURE(wall_seconds, cpu_seconds, body)                               \
+  do {                                                                         \
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();      \
+    clock_t cpu_start = clock();                                               \
+    body;                                                                      \
+    cpu_seconds = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;              \
+    wall_seconds = seconds_since(start);                                       \
+  } while (0)
+
+void run_benchmarks(int system_size) {
+  vector<uint64_t> packed = random_shots(system_size, number_of_shots);
+  shot_batch shots(system_size, packed.data(), number_of_shots);
+  observable_set observables =
+      random_observables(system_size, number_of_observables);
+  vector<vector<int>> subsystems = block_subsystems(system_size);
+  double wall_seconds, cpu_seconds;
+
+  for (int threads : thread_counts) {
+    observable_predictor predictor(observables, system_size, threads);
+    MEASURE(wall_seconds, cpu_seconds, predictor.add_shots(shots));
+    report("predict_observables", system_size, threads, number_of_shots,
+           (long long)observables.size() * number_of_shots, 0, wall_seconds,
+           cpu_seconds);
+
+    renyi_predictor entropy_predictor("auto", threads);
+    MEASURE(wall_seconds, cpu_seconds,
+            entropy_predictor.predict(subsystems, shots));
+    report("predict_entropies", system_size, threads,
+           number_of_shots * (long long)subsystems.size(), subsystems.size(),
+           0, wall_seconds, cpu_seconds);
+
+    correlation_predictor correlations(system_size, threads);
+    MEASURE(wall_seconds, cpu_seconds, correlations.add_shots(shots));
+    report("predict_correlations", system_size, threads, number_of_shots,
+           9LL * system_size * system_size * number_of_shots, 0, wall_seconds,
+           cpu_seconds);
+
+    // 十分大きな測定回数を指定し、number_of_scheme_rows 行だけ生成する
+    scheme_generator generator(observables, 1000000, threads);
+    vector<int> bases;
+    MEASURE(wall_seconds, cpu_seconds, {
+      for (int row = 0; row < number_of_scheme_rows; row++)
+        generator.next(bases);
+    });
+    report("derandomized_scheme", system_size, threads, 0,
+           (long long)observables.size() * number_of_scheme_rows,
+           number_of_scheme_rows, wall_seconds, cpu_seconds);
+  }
+
+  vector<int> bases;
+  random_generator generator(1);
+  MEASURE(wall_seconds, cpu_seconds, {
+    for (long long row = 0; row < number_of_shots; row++)
+      random_bases(generator, system_size, bases);
+  });
+  report("randomized_scheme", system_size, 1, 0, 0, number_of_shots,
+         wall_seconds, cpu_seconds);
+}
+
+vector<int> parse_list(const char *text) {
+  vector<int> list;
+  for (const char *p = text; *p != '\0';) {
+    list.push_back(atoi(p));
+    while (*p != '\0' && *p != ',')
+      p++;
+    if (*p == ',')
+      p++;
+  }
+  return list;
+}
+
+//
+// 以下の関数はこのプログラムの使用法を表示します。
+//
+void print_usage() {
+  fprintf(stderr, "使用法:\n");
+  fprintf(stderr, "./benchmark_shadow [オプション]\n");
+  fprintf(stderr, "    合成したワークロードで -o, -e, -c, -r, -d "
+                  "を計測し、結果を JSON で出力します。\n");
+  fprintf(stderr, "オプション:\n");
+  fprintf(stderr, "    --sizes 10,100,1000 : システムサイズのリスト\n");
+  fprintf(stderr, "    --threads 1,2,4 : スレッド数のリスト\n");
+  fprintf(stderr, "    --shots N : ショット数 (既定値 20000)\n");
+  fprintf(stderr, "    --observables N : 観測量の数 (既定値 20000)\n");
+  fprintf(stderr, "    --rows N : -d で生成する行数 (既定値 20)\n");
+  fprintf(stderr, "    --output [bench.json] : 結果を書き出すファイル\n");
+}
+
+int main(int argc, char *argv[]) {
+  system_sizes = parse_list("10,100,1000");
+  thread_counts = parse_list("1,2,4");
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 == argc) {
+      print_usage();
+      return -1;
+    }
+    if (strcmp(argv[i], "--sizes") == 0)
+      system_sizes = parse_list(argv[++i]);
+    else if (strcmp(argv[i], "--threads") == 0)
+      thread_counts = parse_list(argv[++i]);
+    else if (strcmp(argv[i], "--shots") == 0)
+      number_of_shots = max(1LL, atoll(argv[++i]));
+    else if (strcmp(argv[i], "--observables") == 0)
+      number_of_observables = max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--rows") == 0)
+      number_of_scheme_rows = max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--output") == 0)
+      output_file_name = argv[++i];
+    else {
+      print_usage();
+      return -1;
+    }
+  }
+
+  try {
+    for (int system_size : system_sizes) {
+      if (system_size < 4) {
+        fprintf(stderr,
+                "\n====\nError: システムサイズは 4 以上である必要があります。"
+                "\n====\n");
+        return -1;
+      }
+      run_benchmarks(system_size);
+    }
+  } catch (const exception &error) {
+    fprintf(stderr, "\n====\nError: %s\n====\n", error.what());
+    return -1;
+  }
+
+  FILE *output = stdout;
+  if (output_file_name != NULL) {
+    output = fopen(output_file_name, "w");
+    if (output == NULL) {
+      fprintf(stderr,
+              "\n====\nError: 出力ファイル \"%s\" を作成できません。\n====\n",
+              output_file_name);
+      return -1;
+    }
+  }
+  fprintf(output, "{\n  \"benchmark\": \"benchmark_shadow\",\n");
+  fprintf(output, "  \"shots\": %lld,\n  \"observables\": %d,\n",
+          number_of_shots, number_of_observables);
+  fprintf(output, "  \"results\": [\n");
+  for (int r = 0; r < (int)results.size(); r++)
+    fprintf(output, "%s%s\n", results[r].c_str(),
+            r + 1 < (int)results.size() ? "," : "");
+  fprintf(output, "  ]\n}\n");
+  if (output != stdout)
+    fclose(output);
+  return 0;
+}
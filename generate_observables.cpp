@@ -1,40 +1,86 @@
 //
 // 観測量を生成するプログラム
-// システムサイズ 20 の量子系に対して、特定のパウリ観測量のリストを生成します。
+// 引数を指定しない場合は、システムサイズ 20 の量子系に対して論文の例の
+// パウリ観測量のリスト (族 paper) を generated_observables.txt に書き出します。
+// 族の定義はライブラリ (shadow.h の generate_observable_family) にあります。
 //
-#include <cstdio>
-using namespace std;
+#include "shadow.h"
 
-int system_size = 20;
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
 
-int main() {
-  freopen("generated_observables.txt", "w", stdout);
-  printf("%d\n", system_size);
+using namespace std;
+using namespace shadow;
 
-  // 2-local 観測量 (隣接する量子ビット間の相関など) を生成しているようです
-  for (int i = 0; i < system_size - 1; i++) {
-    for (int j = 0; j < system_size - 1; j++) {
-      if (j == i || j == i + 1 || j + 1 == i)
-        continue;
-      printf("4 Y %d Y %d X %d X %d\n", i, i + 1, j, j + 1);
-    }
+//
+// 以下の関数はこのプログラムの使用法を表示します。
+//
+void print_usage() {
+  fprintf(stderr, "使用法:\n");
+  fprintf(stderr, "./generate_observables\n");
+  fprintf(stderr, "    システムサイズ 20 の族 paper を "
+                  "generated_observables.txt に書き出します。\n");
+  fprintf(stderr, "<または>\n");
+  fprintf(stderr, "./generate_observables [システムサイズ] [族] [族] ...\n");
+  fprintf(stderr, "    指定された族の観測量を標準出力に書き出します。"
+                  "族は以下のいずれかです:\n");
+  fprintf(stderr, "    paper, k-local:K, chain:K, grid:W, pairs, pairs:PQ "
+                  "(例: pairs:ZZ)\n");
+}
+
+int main(int argc, char *argv[]) {
+  int system_size = 20;
+  vector<string> families(1, "paper");
+  FILE *output = NULL;
+  if (argc == 1)
+    output = fopen("generated_observables.txt", "w");
+  else if (argc >= 3) {
+    system_size = atoi(argv[1]);
+    families.assign(argv + 2, argv + argc);
+    output = stdout;
+  } else {
+    print_usage();
+    return -1;
   }
-  for (int i = 0; i < system_size - 1; i++) {
-    for (int j = 0; j < system_size; j++) {
-      if (j == i || j == i + 1)
-        continue;
-      for (int j2 = 0; j2 < system_size; j2++) {
-        if (j2 == i || j2 == i + 1 || j2 == j)
-          continue;
-        printf("4 X %d X %d Z %d Z %d\n", i, i + 1, j, j2);
-      }
-    }
+  if (output == NULL) {
+    fprintf(stderr, "\n====\nError: 出力ファイル \"generated_observables.txt\" "
+                    "を作成できません。\n====\n");
+    return -1;
   }
-  for (int i = 0; i < system_size - 1; i++) {
-    for (int j = 0; j < system_size; j++) {
-      if (j == i || j == i + 1)
-        continue;
-      printf("3 X %d X %d Z %d\n", i, i + 1, j);
+
+  // 行をバッファにためてまとめて書き出す
+  string buffer;
+  char line[64];
+  snprintf(line, sizeof(line), "%d\n", system_size);
+  buffer += line;
+  const char pauli_name[3] = {'X', 'Y', 'Z'};
+  try {
+    for (const string &family : families) {
+      generate_observable_family(
+          family, system_size, [&](const vector<pair<int, int>> &factors) {
+            snprintf(line, sizeof(line), "%d", (int)factors.size());
+            buffer += line;
+            for (const pair<int, int> &factor : factors) {
+              snprintf(line, sizeof(line), " %c %d", pauli_name[factor.second],
+                       factor.first);
+              buffer += line;
+            }
+            buffer += '\n';
+            if (buffer.size() >= (1 << 20)) {
+              fwrite(buffer.data(), 1, buffer.size(), output);
+              buffer.clear();
+            }
+          });
     }
+  } catch (const exception &error) {
+    fprintf(stderr, "\n====\nError: %s\n====\n", error.what());
+    return -1;
   }
+  fwrite(buffer.data(), 1, buffer.size(), output);
+  if (output != stdout)
+    fclose(output);
+  return 0;
 }
@@ -4,205 +4,224 @@
 //  "Predicting Many Properties of a Quantum System from Very Few Measurements"
 //  (非常に少ない測定から量子系の多くの特性を予測する)
 //
+// 予測の本体はライブラリ (shadow.h) にあり、このプログラムはその
+// コマンドラインのラッパーです。
+//
+#include "shadow.h"
+
 #include <algorithm>
-#include <cassert>
-#include <cmath>
-#include <fstream>
 #include <iostream>
-#include <sstream>
+#include <memory>
+#include <stdexcept>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string>
-#include <utility>
 #include <vector>
 
+#include <sys/stat.h>
+
 using namespace std;
+using namespace shadow;
 
 int system_size = -1;
-int number_of_observables;
-
-double renyi_sum_of_binary_outcome[100000000];
-double renyi_number_of_outcomes[100000000];
+int number_of_threads = 1;    // --threads N
+string renyi_engine = "auto"; // --engine: -e で使うエンジン
+int number_of_batches = 1;    // --batches K: -o で中央値平均を出力
 
 //
-// 以下の関数はファイル: observable_file_name を読み込み、
-// [observables] と [observables_acting_on_ith_qubit] を更新します。
+// --profile [profile.json]: 区間ごとの時間、読み込んだバイト数と行数、
+// 部分系ごとの表の大きさと時間などを JSON で書き出します ("-" なら標準エラー
+// 出力)。指定しない場合、計測はほとんど何もしません。
 //
-vector<vector<pair<int, int>>> observables; // 予測する観測量 (Pauli observable)
-vector<vector<vector<int>>> observables_acting_on_ith_qubit;
-void read_all_observables(char *observable_file_name) {
-  ifstream observable_fstream;
-  observable_fstream.open(observable_file_name, ifstream::in);
-
-  if (observable_fstream.fail()) {
-    fprintf(stderr,
-            "\n====\nError: 入力ファイル \"%s\" が存在しません。\n====\n",
-            observable_file_name);
-    exit(-1);
-  }
+const char *profile_file_name = NULL;
+profile_report profile;
+long long bytes_parsed = 0; // 読み込んだ測定データのバイト数
+long long rows_parsed = 0;  // 読み込んだショットの数
+
+long long file_size(const char *file_name) {
+  struct stat file_status;
+  return stat(file_name, &file_status) == 0 ? (long long)file_status.st_size
+                                            : 0;
+}
 
-  // システムサイズを読み込む
-  int system_size_observable;
-  observable_fstream >> system_size_observable;
-  if (system_size == -1)
-    system_size = system_size_observable;
+//
+// 以下の関数は測定ファイルを読み込み、読み込んだ量を記録します。
+//
+void read_measurements(const char *measurement_file_name,
+                       shot_batch &measurements) {
+  profile.phase("read_measurements");
+  measurements.read_file(measurement_file_name, number_of_threads);
+  bytes_parsed = file_size(measurement_file_name);
+  rows_parsed = measurements.size();
+}
 
-  // 以下の数値を初期化 (後で変更される)
-  number_of_observables = 0;
+//
+// 以下の関数は [subsystem.txt] の部分系を返します。その名前のファイルが
+// なく、chain または subsets: で始まる場合は部分系の族として扱います。
+//
+vector<vector<int>> read_subsystem_list(const char *subsystem_file_name,
+                                        int system_size) {
+  struct stat file_status;
+  if (stat(subsystem_file_name, &file_status) != 0 &&
+      (strncmp(subsystem_file_name, "chain", 5) == 0 ||
+       strncmp(subsystem_file_name, "subsets:", 8) == 0))
+    return generate_subsystem_family(subsystem_file_name, system_size);
+  return read_subsystems(subsystem_file_name, NULL, number_of_threads);
+}
 
-  //
-  // observables_acting_on_ith_qubit の構造:
-  //   observables_acting_on_ith_qubit[ith_qubit][0 or 1 or 2]
-  //     ith_qubit に対して X (0), Y (1), Z (2)
-  //     を適用する観測量のインデックスリストを返します
-  //
-  observables_acting_on_ith_qubit.clear();
-  vector<int> single_list;
-  vector<vector<int>> pauli_list;
-  pauli_list.push_back(single_list);
-  pauli_list.push_back(single_list);
-  pauli_list.push_back(single_list);
-  for (int i = 0; i < system_size; i++) {
-    observables_acting_on_ith_qubit.push_back(pauli_list);
+//
+// 以下の関数は部分系ごとの計測結果を JSON の配列にします。
+//
+string subsystem_profile_json(const vector<vector<int>> &subsystems,
+                              const vector<renyi_subsystem_profile> &profiles) {
+  string json = "[";
+  for (int s = 0; s < (int)profiles.size(); s++) {
+    char entry[256];
+    snprintf(entry, sizeof(entry),
+             "%s\n    {\"size\": %d, \"engine\": \"%s\", "
+             "\"table_entries\": %lld, \"seconds\": %.6f}",
+             s == 0 ? "" : ",", (int)subsystems[s].size(),
+             profiles[s].engine.c_str(), profiles[s].table_entries,
+             profiles[s].seconds);
+    json += entry;
   }
+  return json + "\n  ]";
+}
 
-  // 局所観測量を行ごとに読み込む
-  string line;
-  int observable_counter = 0;
-  while (getline(observable_fstream, line)) {
-    if (line == "\n" || line == "")
-      continue;
-    istringstream single_line_stream(line);
-
-    int k_local;
-    single_line_stream >> k_local;
-
-    vector<pair<int, int>> ith_observable;
-
-    for (int k = 0; k < k_local; k++) {
-      char pauli_observable[5];
-      int position_of_pauli;
-      single_line_stream >> pauli_observable >> position_of_pauli;
-
-      assert(pauli_observable[0] == 'X' || pauli_observable[0] == 'Y' ||
-             pauli_observable[0] == 'Z');
-
-      int pauli_encoding = pauli_observable[0] - 'X'; // X -> 0, Y -> 1, Z -> 2
-
-      observables_acting_on_ith_qubit[position_of_pauli][pauli_encoding]
-          .push_back(observable_counter);
-      ith_observable.push_back(make_pair(position_of_pauli, pauli_encoding));
-    }
-
-    observables.push_back(ith_observable);
-    observable_counter++;
+//
+// 以下の関数は各観測量の予測値を出力します。--batches K (K > 1) の場合は
+// 中央値平均、分散、95% 信頼区間の下限と上限を 1 行に出力します。
+//
+void print_observable_predictions(const observable_predictor &predictor) {
+  for (int i = 0; i < predictor.size(); i++) {
+    if (predictor.number_of_measurements(i) == 0) {
+      fprintf(stderr, "%d-th Observable is not measured at all\n", i + 1);
+      printf(number_of_batches > 1 ? "0 0 0 0\n" : "0\n");
+    } else if (number_of_batches > 1) {
+      median_of_means_estimate estimate = predictor.median_of_means(i);
+      printf("%f %f %f %f\n", estimate.estimate, estimate.variance,
+             estimate.lower, estimate.upper);
+    } else
+      printf("%f\n", predictor.estimate(i));
   }
-  number_of_observables = observable_counter;
-  observable_fstream.close();
-
-  return;
 }
 
 //
-// 以下の関数はファイル: subsystem_file_name を読み込み、
-// [subsystems] を更新します。
+// 以下の関数は 2 点相関の予測値を書き出します。出力ファイルの名前が .bin で
+// 終わる場合はバイナリ形式、"-" の場合は標準出力に CSV で書き出します。
 //
-vector<vector<int>> subsystems; // エントロピーを予測する部分系
-void read_all_subsystems(char *subsystem_file_name) {
-  ifstream subsystem_fstream;
-  subsystem_fstream.open(subsystem_file_name, ifstream::in);
-
-  if (subsystem_fstream.fail()) {
-    fprintf(stderr,
-            "\n====\nError: 入力ファイル \"%s\" が存在しません。\n====\n",
-            subsystem_file_name);
-    exit(-1);
+void write_correlations(const correlation_predictor &predictor,
+                        const char *output_file_name) {
+  size_t length = strlen(output_file_name);
+  if (length >= 4 && strcmp(output_file_name + length - 4, ".bin") == 0) {
+    predictor.write_binary(output_file_name);
+    return;
   }
-
-  // システムサイズを読み込む
-  int system_size_subsystem;
-  subsystem_fstream >> system_size_subsystem;
-  if (system_size == -1)
-    system_size = system_size_subsystem;
-
-  // 局所観測量を行ごとに読み込む
-  string line;
-  int observable_counter = 0;
-  while (getline(subsystem_fstream, line)) {
-    if (line == "\n" || line == "")
-      continue;
-    istringstream single_line_stream(line);
-
-    int k_local;
-    single_line_stream >> k_local;
-
-    vector<int> ith_subsystem;
-
-    for (int k = 0; k < k_local; k++) {
-      int position_of_the_qubit;
-      single_line_stream >> position_of_the_qubit;
-      ith_subsystem.push_back(position_of_the_qubit);
-    }
-
-    subsystems.push_back(ith_subsystem);
+  if (strcmp(output_file_name, "-") == 0) {
+    predictor.write_csv(stdout);
+    return;
   }
-  subsystem_fstream.close();
-
-  return;
+  FILE *output = fopen(output_file_name, "w");
+  if (output == NULL)
+    throw runtime_error(string("出力ファイル \"") + output_file_name +
+                        "\" を作成できません。");
+  predictor.write_csv(output);
+  fclose(output);
 }
 
 //
-// 以下の関数はファイル: measurement_file_name を読み込み、
-// [observables] と [observables_acting_on_ith_qubit] を更新します。
+// ストリーミングモード: [measurement.txt] に "-" を指定すると、
+// 測定結果を標準入力から 1 行ずつ読み込みます。
+// ショットは 256 個ずつ小さなバッファにためてから処理されるので、
+// 使用メモリはショット数によらず一定です。
 //
-vector<vector<int>> measurement_pauli_basis;
-vector<vector<int>> measurement_binary_outcome;
-void read_all_measurements(char *measurement_file_name) {
-  ifstream measurement_fstream;
-  measurement_fstream.open(measurement_file_name, ifstream::in);
-
-  if (measurement_fstream.fail()) {
-    fprintf(stderr,
-            "\n====\nError: 入力ファイル \"%s\" が存在しません。\n====\n",
-            measurement_file_name);
-    exit(-1);
-  }
+const int stream_buffer_size = 256;
+long long refresh_interval = 0; // --every N: N ショットごとに予測値を出力
+
+void open_measurement_stream() {
+  ios::sync_with_stdio(false);
 
   // システムサイズを読み込む
-  int system_size_measurement;
-  measurement_fstream >> system_size_measurement;
+  string line;
+  while (getline(cin, line) && (line == "\n" || line == ""))
+    ;
+  int system_size_measurement = atoi(line.c_str());
   if (system_size == -1)
     system_size = system_size_measurement;
-  if (system_size_measurement != system_size) {
-    fprintf(stderr, "\n====\nError: システムサイズが一致しません。\n====\n");
-    exit(-1);
-  }
+  if (system_size_measurement != system_size || system_size <= 0)
+    throw runtime_error("システムサイズが一致しません。");
+}
+
+//
+// 以下の関数は標準入力のショットをバッファごとに process_shots(shots, count)
+// に渡し、refresh_interval ショットごとと入力の終わりに report() を
+// 呼び出します。
+//
+template <class ProcessShots, class Report>
+void stream_measurements(ProcessShots process_shots, Report report) {
+  int stride = shot_stride(system_size);
+  vector<uint64_t> buffer((size_t)stride * stream_buffer_size);
+  long long buffered_shots = 0;
+  long long number_of_shots = 0;
 
-  // 測定結果を行ごとに読み込む
   string line;
-  int measurement_counter = 0;
-  while (getline(measurement_fstream, line)) {
+  while (getline(cin, line)) {
     if (line == "\n" || line == "")
       continue;
-    istringstream single_line_stream(line);
-
-    vector<int> empty_list;
-    measurement_pauli_basis.push_back(empty_list);
-    measurement_binary_outcome.push_back(empty_list);
-    for (int ith_qubit = 0; ith_qubit < system_size; ith_qubit++) {
-      char pauli[10];
-      int binary_outcome;
-      single_line_stream >> pauli >> binary_outcome;
-      assert(binary_outcome == 1 || binary_outcome == -1);
-
-      measurement_pauli_basis[measurement_counter].push_back(pauli[0] - 'X');
-      measurement_binary_outcome[measurement_counter].push_back(binary_outcome);
+
+    uint64_t *shot = &buffer[buffered_shots * stride];
+    fill(shot, shot + stride, 0);
+    parse_measurement_line(line, system_size, shot);
+    buffered_shots++;
+    number_of_shots++;
+    bytes_parsed += line.size() + 1;
+
+    bool is_refresh =
+        refresh_interval > 0 && number_of_shots % refresh_interval == 0;
+    if (buffered_shots == stream_buffer_size || is_refresh) {
+      process_shots(buffer.data(), buffered_shots);
+      buffered_shots = 0;
+    }
+    if (is_refresh) {
+      fprintf(stderr, "[Shots %lld]\n", number_of_shots);
+      report();
+      fflush(stdout);
     }
+  }
 
-    measurement_counter++;
+  process_shots(buffer.data(), buffered_shots);
+  rows_parsed = number_of_shots;
+  if (refresh_interval == 0 || number_of_shots % refresh_interval != 0) {
+    fprintf(stderr, "[Shots %lld]\n", number_of_shots);
+    report();
   }
 }
 
+//
+// 以下の関数はコマンドライン引数からオプション (--every N など) を取り除き、
+// 残りの引数を返します。
+//
+vector<char *> parse_options(int argc, char *argv[]) {
+  vector<char *> arguments;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--every") == 0 && i + 1 < argc) {
+      refresh_interval = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      number_of_threads = max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--batches") == 0 && i + 1 < argc) {
+      number_of_batches = max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      renyi_engine = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_file_name = argv[++i];
+    } else
+      arguments.push_back(argv[i]);
+  }
+  return arguments;
+}
+
 //
 // 以下の関数はこのプログラムの使用法を表示します。
 //
@@ -221,155 +240,296 @@ void print_usage() {
       stderr,
       "    [subsystem.txt] "
       "で指定された各部分系について、予測されたエントロピーを出力します。\n");
+  fprintf(stderr, "    [subsystem.txt] の代わりに部分系の族 chain (chain:L) "
+                  "または subsets:K も指定できます。\n");
+  fprintf(stderr, "<または>\n");
+  fprintf(stderr,
+          "./prediction_shadow -c [measurement.txt] [correlations.csv]\n");
+  fprintf(stderr, "    このオプションはすべての量子ビットの組 (i, j) と "
+                  "パウリの組 (P, Q) について、\n");
+  fprintf(stderr, "    2 点相関 <P_i Q_j> を予測して n x n x 9 "
+                  "の表を書き出します。\n");
+  fprintf(stderr, "    出力ファイルの名前が .bin で終わる場合はバイナリ形式で、"
+                  "- なら標準出力に書き出します。\n");
+  fprintf(stderr, "<または>\n");
+  fprintf(stderr,
+          "./prediction_shadow -b [measurement.txt] [measurement.bin]\n");
+  fprintf(stderr, "    このオプションは測定データをバイナリ形式に変換します。\n");
+  fprintf(stderr, "    -o, -e, -c の [measurement.txt] には変換後の "
+                  "[measurement.bin] も指定でき、mmap して読み込まれます。\n");
+  fprintf(stderr, "オプション:\n");
+  fprintf(stderr, "    -o, -e, -c の [measurement.txt] に - を指定すると、"
+                  "測定結果を標準入力から逐次読み込みます。\n");
+  fprintf(stderr, "    --every N : 標準入力から読み込む場合、"
+                  "N ショットごとに予測値を出力します。\n");
+  fprintf(stderr, "    --threads N : -o では測定データを、-e では部分系を、"
+                  "-c では量子ビットの組を\n");
+  fprintf(stderr, "        N 個のスレッドで分割して処理します。\n");
+  fprintf(stderr, "        入力ファイルの解析も N "
+                  "個のスレッドで並列に行います。\n");
+  fprintf(stderr, "    --batches K : -o "
+                  "でショットを K 個のバッチに分けて 1 回の走査で集計し、\n");
+  fprintf(stderr, "        中央値平均、分散、95%% "
+                  "信頼区間の下限と上限を出力します。\n");
+  fprintf(stderr, "    --engine dense|sparse|kernel|closure|histogram|auto : "
+                  "-e で使うエンジンを選びます。\n");
+  fprintf(stderr, "        sparse は実際に現れた");
+  fprintf(stderr, "パウリ文字列だけを保持し、kernel "
+                  "はショットのペアから純度を推定します。\n");
+  fprintf(stderr, "        closure は部分系の部分集合を共有して、"
+                  "すべての部分系の表を 1 回の走査で作ります。\n");
+  fprintf(stderr, "        histogram は (基底, 測定結果) のヒストグラムを "
+                  "量子ビットごとに変換して表を作ります。\n");
+  fprintf(stderr, "        auto は大きな部分系でショットが少ないと kernel "
+                  "を選び、その部分系を標準エラー出力に示します。\n");
+  fprintf(stderr, "        kernel は各量子ビットの基底が一様ランダム (-r) "
+                  "であることを仮定するので、-d, -a, -g の\n");
+  fprintf(stderr, "        スキームや量子ビットが重複する部分系では "
+                  "dense か sparse を指定してください。\n");
+  fprintf(stderr, "    --profile [profile.json] : 区間ごとの時間、"
+                  "読み込んだデータの量、部分系ごとの表の大きさと\n");
+  fprintf(stderr, "        時間、最大使用メモリを JSON "
+                  "で書き出します (- なら標準エラー出力)。\n");
   return;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    print_usage();
-    return -1;
-  }
+//
+// 以下の関数は argv[1] のモードを実行します (引数の数は main で
+// 4 であることを確認済みです)。
+//
+int run(char *argv[]) {
+  bool is_streaming = strcmp(argv[2], "-") == 0;
 
   //
   // 局所観測量の予測を実行
   //
   if (strcmp(argv[1], "-o") == 0) {
-    read_all_measurements(argv[2]);
-    read_all_observables(argv[3]);
-
-    // すべての観測量について、
-    // 現在の測定繰り返しにおいて、その観測量を測定するために
-    // いくつのパウリ演算子が一致する必要があるか
-    vector<int> how_many_pauli_to_match;
-    how_many_pauli_to_match.resize(number_of_observables);
-
-    // すべての観測量について、
-    // この単一量子ビット測定までの累積結果を保存
-    vector<int> cumulative_measurement;
-    cumulative_measurement.resize(number_of_observables);
-
-    // すべての観測量について、
-    // それが何回測定されたかを保存 (マッチした場合のみカウント)
-    vector<int> number_of_measurements;
-    number_of_measurements.resize(number_of_observables);
-
-    // すべての観測量について、
-    // 測定結果の合計を保存
-    vector<int> sum_of_measurement_results;
-    sum_of_measurement_results.resize(number_of_observables);
-
-    // 測定データを走査:
-    //    measurement_pauli_basis, measurement_binary_outcome
-    // 局所観測量を計算するために
-    for (int t = 0; t < (int)measurement_pauli_basis.size(); t++) {
-      for (int i = 0; i < (int)observables.size(); i++) {
-        how_many_pauli_to_match[i] =
-            observables[i].size();     // k-local 観測量の場合は k で初期化
-        cumulative_measurement[i] = 1; // 1 で初期化
-      }
-
-      for (int ith_qubit = 0; ith_qubit < system_size; ith_qubit++) {
-        int pauli = measurement_pauli_basis[t][ith_qubit];
-        int binary_outcome = measurement_binary_outcome[t][ith_qubit];
-        for (int i : observables_acting_on_ith_qubit[ith_qubit][pauli]) {
-          how_many_pauli_to_match[i]--;
-          cumulative_measurement[i] *= binary_outcome;
-        }
-      }
-
-      for (int i = 0; i < (int)observables.size(); i++) {
-        if (how_many_pauli_to_match[i] == 0) {
-          number_of_measurements[i]++;
-          sum_of_measurement_results[i] += cumulative_measurement[i];
-        }
-      }
+    // ファイルの測定データはバックグラウンドで解析しながら読み込む
+    unique_ptr<measurement_reader> reader;
+    if (is_streaming)
+      open_measurement_stream();
+    else {
+      profile.phase("open_measurements");
+      reader.reset(new measurement_reader(argv[2], number_of_threads));
+      system_size = reader->system_size();
     }
-
-    for (int i = 0; i < (int)observables.size(); i++) {
-      if (number_of_measurements[i] == 0) {
-        fprintf(stderr, "%d-th Observable is not measured at all\n", i + 1);
-        printf("0\n");
-      } else
-        printf("%f\n",
-               1.0 * sum_of_measurement_results[i] / number_of_measurements[i]);
+    profile.phase("read_observables");
+    observable_set observables;
+    observables.read_file(argv[3], number_of_threads);
+    profile.add("observables", observables.size());
+
+    // すべての観測量について、それが何回測定されたか
+    // (マッチした場合のみカウント) と測定結果の合計を保存
+    observable_predictor predictor(observables, system_size,
+                                   is_streaming ? 1 : number_of_threads,
+                                   number_of_batches);
+
+    // ビットパックされた測定データを走査して局所観測量を計算
+    if (is_streaming) {
+      profile.phase("stream");
+      stream_measurements(
+          [&](const uint64_t *shots, long long count) {
+            predictor.add_shots(shots, count);
+          },
+          [&]() { print_observable_predictions(predictor); });
+      profile.finish();
+      profile.add("shots_per_second", rows_parsed / profile.seconds_of("stream"));
+    } else {
+      profile.phase("parse_and_accumulate");
+      const uint64_t *shots;
+      long long count;
+      while (reader->next(shots, count)) {
+        predictor.add_shots(shots, count);
+        rows_parsed += count;
+      }
+      bytes_parsed = file_size(argv[2]);
+      profile.phase("output");
+      print_observable_predictions(predictor);
+      profile.finish();
+      profile.add("shots_per_second",
+                  rows_parsed / profile.seconds_of("parse_and_accumulate"));
     }
   }
   //
   // エンタングルメントエントロピーの予測を実行
   //
-  else if (strcmp(argv[1], "-e") == 0) {
-    read_all_measurements(argv[2]);
-    read_all_subsystems(argv[3]);
+  else if (strcmp(argv[1], "-e") == 0 && is_streaming) {
+    open_measurement_stream();
+    profile.phase("read_subsystems");
+    vector<vector<int>> subsystems = read_subsystem_list(argv[3], system_size);
 
+    // ストリーミングでは、すべての部分系の密な表を同時に保持する
+    vector<dense_renyi_accumulator> accumulators;
     for (int s = 0; s < (int)subsystems.size(); s++) {
-      int subsystem_size = (int)subsystems[s].size();
-
-      for (int c = 0; c < (1 << (2 * subsystem_size)); c++) {
-        renyi_sum_of_binary_outcome[c] = 0;
-        renyi_number_of_outcomes[c] = 0;
+      if ((int)subsystems[s].size() > max_dense_subsystem_size) {
+        fprintf(stderr,
+                "\n====\nError: ストリーミングでは部分系のサイズは %d "
+                "以下である必要があります。\n====\n",
+                max_dense_subsystem_size);
+        return -1;
       }
+      accumulators.push_back(
+          dense_renyi_accumulator(subsystems[s], system_size));
+    }
 
-      for (int t = 0; t < (int)measurement_pauli_basis.size(); t++) {
-        long long encoding = 0, cumulative_outcome = 1;
-
-        renyi_sum_of_binary_outcome[0] += 1;
-        renyi_number_of_outcomes[0] += 1;
-
-        // グレイコード (Gray code) を使用して、すべての 2^n
-        // 個の可能な結果を反復処理
-        for (long long b = 1; b < (1 << subsystem_size); b++) {
-          long long change_i = __builtin_ctzll(b);
-          long long index_in_original_system = subsystems[s][change_i];
-
-          cumulative_outcome *=
-              measurement_binary_outcome[t][index_in_original_system];
-          encoding ^= (measurement_pauli_basis[t][index_in_original_system] + 1)
-                      << (2LL * change_i);
-
-          renyi_sum_of_binary_outcome[encoding] += cumulative_outcome;
-          renyi_number_of_outcomes[encoding] += 1;
+    vector<renyi_subsystem_profile> subsystem_profiles(subsystems.size());
+    for (int s = 0; s < (int)subsystems.size(); s++)
+      subsystem_profiles[s] = {"dense", 1LL << (2 * subsystems[s].size()), 0.0};
+
+    profile.phase("stream");
+    stream_measurements(
+        [&](const uint64_t *shots, long long count) {
+          for (int s = 0; s < (int)accumulators.size(); s++) {
+            if (!profile.enabled()) {
+              accumulators[s].add_shots(shots, count);
+              continue;
+            }
+            double start = wall_clock_seconds();
+            accumulators[s].add_shots(shots, count);
+            subsystem_profiles[s].seconds += wall_clock_seconds() - start;
+          }
+        },
+        [&]() {
+          for (int s = 0; s < (int)accumulators.size(); s++)
+            printf("%f\n", accumulators[s].entropy());
+        });
+    profile.finish();
+    profile.add("shots_per_second", rows_parsed / profile.seconds_of("stream"));
+    profile.add_json("subsystems",
+                     subsystem_profile_json(subsystems, subsystem_profiles));
+  } else if (strcmp(argv[1], "-e") == 0) {
+    shot_batch measurements;
+    read_measurements(argv[2], measurements);
+    profile.phase("read_subsystems");
+    vector<vector<int>> subsystems =
+        read_subsystem_list(argv[3], measurements.system_size());
+
+    profile.phase("predict");
+    renyi_predictor predictor(renyi_engine, number_of_threads);
+    vector<renyi_subsystem_profile> subsystem_profiles;
+    vector<double> predicted_entropies = predictor.predict(
+        subsystems, measurements,
+        profile.enabled() ? &subsystem_profiles : NULL);
+    profile.phase("output");
+    for (int s = 0; s < (int)subsystems.size(); s++)
+      printf("%f\n", predicted_entropies[s]);
+
+    // auto がペアのエンジンを選んだ部分系は、基底が一様ランダムでない
+    // データ (-d, -a, -g のスキームや量子ビットが重複する部分系) では
+    // dense や sparse と異なる値になり得るので知らせる
+    if (renyi_engine == "auto") {
+      for (int s = 0; s < (int)subsystems.size(); s++)
+        if (predictor.engine_for((int)subsystems[s].size(),
+                                 measurements.size()) == "kernel")
+          fprintf(stderr,
+                  "%d-th subsystem is predicted by the kernel engine, which "
+                  "assumes uniformly random bases\n",
+                  s + 1);
+    }
+    profile.finish();
+    profile.add("shots_per_second", rows_parsed / profile.seconds_of("predict"));
+    profile.add_json("subsystems",
+                     subsystem_profile_json(subsystems, subsystem_profiles));
+  }
+  //
+  // すべての 2 点相関の予測を実行
+  //
+  else if (strcmp(argv[1], "-c") == 0) {
+    unique_ptr<measurement_reader> reader;
+    if (is_streaming)
+      open_measurement_stream();
+    else {
+      profile.phase("open_measurements");
+      reader.reset(new measurement_reader(argv[2], number_of_threads));
+      system_size = reader->system_size();
+    }
+    correlation_predictor predictor(system_size,
+                                    is_streaming ? 1 : number_of_threads);
+    profile.add("correlators", 9.0 * system_size * system_size);
+
+    if (is_streaming) {
+      profile.phase("stream");
+      stream_measurements(
+          [&](const uint64_t *shots, long long count) {
+            predictor.add_shots(shots, count);
+          },
+          [&]() { write_correlations(predictor, argv[3]); });
+      profile.finish();
+      profile.add("shots_per_second",
+                  rows_parsed / profile.seconds_of("stream"));
+    } else {
+      // 読み込んだショットは correlation_block_shots 個ためてから転置する
+      profile.phase("parse_and_accumulate");
+      int stride = shot_stride(system_size);
+      vector<uint64_t> pending;
+      const uint64_t *shots;
+      long long count;
+      while (reader->next(shots, count)) {
+        rows_parsed += count;
+        if (pending.empty() && count >= correlation_block_shots) {
+          predictor.add_shots(shots, count);
+          continue;
         }
-      }
-      vector<int> level_cnt(2 * subsystem_size, 0);
-      vector<int> level_ttl(2 * subsystem_size, 0);
-
-      for (long long c = 0; c < (1 << (2 * subsystem_size)); c++) {
-        int nonId = 0;
-        for (int i = 0; i < subsystem_size; i++) {
-          nonId += ((c >> (2 * i)) & 3) != 0;
+        pending.insert(pending.end(), shots, shots + count * stride);
+        if ((long long)pending.size() >=
+            (long long)correlation_block_shots * stride) {
+          predictor.add_shots(pending.data(), pending.size() / stride);
+          pending.clear();
         }
-        if (renyi_number_of_outcomes[c] >= 2)
-          level_cnt[nonId]++;
-        level_ttl[nonId]++;
       }
-
-      double predicted_entropy = 0;
-      for (long long c = 0; c < (1 << (2 * subsystem_size)); c++) {
-        if (renyi_number_of_outcomes[c] <= 1)
-          continue;
-
-        int nonId = 0;
-        for (int i = 0; i < subsystem_size; i++)
-          nonId += ((c >> (2 * i)) & 3) != 0;
-
-        predicted_entropy +=
-            ((double)1.0) /
-            (renyi_number_of_outcomes[c] * (renyi_number_of_outcomes[c] - 1)) *
-            (renyi_sum_of_binary_outcome[c] * renyi_sum_of_binary_outcome[c] -
-             renyi_number_of_outcomes[c]) /
-            (1LL << subsystem_size) * level_ttl[nonId] / level_cnt[nonId];
-      }
-
-      printf("%f\n", -1.0 * log2(min(max(predicted_entropy,
-                                         1.0 / pow(2.0, subsystem_size)),
-                                     1.0 - 1e-9)));
+      predictor.add_shots(pending.data(), pending.size() / stride);
+      bytes_parsed = file_size(argv[2]);
+      profile.phase("output");
+      write_correlations(predictor, argv[3]);
+      profile.finish();
+      profile.add("shots_per_second",
+                  rows_parsed / profile.seconds_of("parse_and_accumulate"));
     }
   }
   //
+  // 測定データをバイナリ形式に変換
+  //
+  else if (strcmp(argv[1], "-b") == 0) {
+    shot_batch measurements;
+    read_measurements(argv[2], measurements);
+    profile.phase("write_binary");
+    measurements.write_binary(argv[3]);
+    profile.finish();
+  }
+  //
   // 上記のいずれにも該当しない (入力が無効)
   //
   else {
     print_usage();
     return -1;
   }
+
+  profile.add_json("mode", string("\"") + argv[1] + "\"");
+  profile.add("threads", number_of_threads);
+  if (number_of_batches > 1)
+    profile.add("batches", number_of_batches);
+  profile.add("bytes_parsed", bytes_parsed);
+  profile.add("rows_parsed", rows_parsed);
+  if (profile.enabled())
+    profile.write(profile_file_name);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  vector<char *> arguments = parse_options(argc, argv);
+  argc = (int)arguments.size();
+  argv = arguments.data();
+  if (argc != 4) {
+    print_usage();
+    return -1;
+  }
+
+  try {
+    if (profile_file_name != NULL)
+      profile = profile_report(true);
+    return run(argv);
+  } catch (const exception &error) {
+    fprintf(stderr, "\n====\nError: %s\n====\n", error.what());
+    return -1;
+  }
 }
@@ -0,0 +1,4028 @@
+//
+// このコードは Hsin-Yuan Huang (https://momohuang.github.io/)
+// によって作成されました。 詳細は以下の論文を参照してください:
+//  "Predicting Many Properties of a Quantum System from Very Few Measurements"
+//  (非常に少ない測定から量子系の多くの特性を予測する)
+//
+// 古典シャドウのライブラリ (shadow.h) の実装です。
+//
+#include "shadow.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdarg.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace shadow {
+
+const int INF = 999999999; // 無限大として扱う非常に大きな数
+
+//
+// 以下の関数は printf 形式のメッセージで std::runtime_error を送出します。
+//
+[[noreturn]] void fail(const char *format, ...) {
+  char message[1024];
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(message, sizeof(message), format, arguments);
+  va_end(arguments);
+  throw runtime_error(message);
+}
+
+//
+// テキストファイルの高速な読み込み:
+//   ファイルは mmap され (できない場合は一度に読み込まれ)、行の境界で
+//   text_chunk_bytes 程度のチャンクに分けられます。チャンクは互いに独立に
+//   解析できるので、複数のスレッドで並列に処理されます。トークンは
+//   istringstream を使わずに文字列を直接走査して読み取ります。
+//
+const size_t text_chunk_bytes = 1 << 22;
+
+class text_file {
+public:
+  explicit text_file(const string &file_name) : mapped_(NULL), size_(0) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+      fail("入力ファイル \"%s\" が存在しません。", file_name.c_str());
+    struct stat file_status;
+    if (fstat(fd, &file_status) == 0 && S_ISREG(file_status.st_mode) &&
+        file_status.st_size > 0) {
+      void *mapped =
+          mmap(NULL, file_status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        madvise(mapped, file_status.st_size, MADV_SEQUENTIAL);
+        mapped_ = mapped;
+        size_ = file_status.st_size;
+      }
+    }
+    if (mapped_ == NULL) {
+      char buffer[1 << 16];
+      ssize_t length;
+      while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+        contents_.append(buffer, length);
+    }
+    close(fd);
+  }
+  text_file(const text_file &) = delete;
+  text_file &operator=(const text_file &) = delete;
+  ~text_file() {
+    if (mapped_ != NULL)
+      munmap(mapped_, size_);
+  }
+
+  const char *begin() const {
+    return mapped_ != NULL ? (const char *)mapped_ : contents_.data();
+  }
+  const char *end() const {
+    return begin() + (mapped_ != NULL ? size_ : contents_.size());
+  }
+
+private:
+  void *mapped_;
+  size_t size_;
+  string contents_;
+};
+
+//
+// 解析の失敗はその位置とともに送出され、呼び出し元で行番号つきの
+// メッセージに変換されます。
+//
+struct text_parse_error {
+  const char *position;
+};
+
+[[noreturn]] void fail_at(const string &file_name, const text_file &file,
+                          const char *position) {
+  long long line_number = 1 + count(file.begin(), position, '\n');
+  fail("\"%s\" の %lld 行目の形式が正しくありません。", file_name.c_str(),
+       line_number);
+}
+
+inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+inline const char *skip_blanks(const char *p, const char *end) {
+  while (p != end && is_blank(*p))
+    p++;
+  return p;
+}
+
+inline const char *end_of_line(const char *p, const char *end) {
+  const void *newline = memchr(p, '\n', end - p);
+  return newline != NULL ? (const char *)newline : end;
+}
+
+inline bool is_blank_line(const char *p, const char *line_end) {
+  return skip_blanks(p, line_end) == line_end;
+}
+
+//
+// 以下の関数は p から整数を読み、その直後の位置を返します。
+// 整数がなければ NULL を返します。
+//
+inline const char *scan_int(const char *p, const char *end, int &value) {
+  p = skip_blanks(p, end);
+  bool is_negative = false;
+  if (p != end && (*p == '-' || *p == '+')) {
+    is_negative = *p == '-';
+    p++;
+  }
+  if (p == end || *p < '0' || *p > '9')
+    return NULL;
+  long long magnitude = 0;
+  for (; p != end && *p >= '0' && *p <= '9'; p++) {
+    magnitude = magnitude * 10 + (*p - '0');
+    if (magnitude > INT_MAX)
+      return NULL;
+  }
+  value = (int)(is_negative ? -magnitude : magnitude);
+  return p;
+}
+
+//
+// 以下の関数は p からパウリ演算子 ("X", "Y", "Z" で始まるトークン) を読み、
+// その直後の位置を返します。なければ NULL を返します。
+//
+inline const char *scan_pauli(const char *p, const char *end, int &pauli) {
+  p = skip_blanks(p, end);
+  if (p == end || *p < 'X' || *p > 'Z')
+    return NULL;
+  pauli = *p - 'X'; // X -> 0, Y -> 1, Z -> 2
+  while (p != end && !is_blank(*p))
+    p++;
+  return p;
+}
+
+//
+// 以下の関数はファイルの先頭のシステムサイズを読み、その直後の位置を
+// 返します。
+//
+const char *scan_header(const string &file_name, const text_file &file,
+                        int &system_size) {
+  const char *p = file.begin();
+  while (p != file.end() && (is_blank(*p) || *p == '\n'))
+    p++;
+  const char *after_header = scan_int(p, file.end(), system_size);
+  if (after_header == NULL)
+    fail_at(file_name, file, p);
+  return after_header;
+}
+
+//
+// 以下の関数は [begin, end) を行の境界で text_chunk_bytes 程度ごとに分け、
+// 各チャンクの先頭の位置と end を返します。
+//
+vector<const char *> split_into_chunks(const char *begin, const char *end) {
+  vector<const char *> boundaries(1, begin);
+  const char *p = begin;
+  while ((size_t)(end - p) > text_chunk_bytes) {
+    p = end_of_line(p + text_chunk_bytes, end);
+    if (p != end)
+      p++;
+    boundaries.push_back(p);
+  }
+  if (p != end)
+    boundaries.push_back(end);
+  return boundaries;
+}
+
+//
+// 以下の関数は task(0), ..., task(number_of_tasks - 1) を
+// number_of_threads 個のスレッドで実行します。例外が送出された場合は、
+// 番号の最も小さいタスクの例外を送出し直します。
+//
+void parallel_for(int number_of_tasks, int number_of_threads,
+                  const function<void(int)> &task) {
+  vector<exception_ptr> errors(number_of_tasks);
+  atomic<int> next_task(0);
+  auto work = [&]() {
+    for (int t = next_task++; t < number_of_tasks; t = next_task++) {
+      try {
+        task(t);
+      } catch (...) {
+        errors[t] = current_exception();
+      }
+    }
+  };
+  vector<thread> workers;
+  for (int i = 1; i < min(number_of_threads, number_of_tasks); i++)
+    workers.push_back(thread(work));
+  work();
+  for (thread &worker : workers)
+    worker.join();
+  for (int t = 0; t < number_of_tasks; t++)
+    if (errors[t])
+      rethrow_exception(errors[t]);
+}
+
+//
+// 以下の関数は [p, end) の空白でない行の数を返します。
+//
+long long count_nonblank_lines(const char *p, const char *end) {
+  long long number_of_lines = 0;
+  while (p != end) {
+    const char *line_end = end_of_line(p, end);
+    if (!is_blank_line(p, line_end))
+      number_of_lines++;
+    p = line_end == end ? end : line_end + 1;
+  }
+  return number_of_lines;
+}
+
+//
+// 以下の関数は測定結果 1 行 [p, line_end) をビットパック表現に変換し、
+// shot (0 で初期化されたワード) に書き込みます。
+//
+inline void parse_measurement_row(const char *p, const char *line_end,
+                                  int system_size, uint64_t *shot) {
+  for (int ith_qubit = 0; ith_qubit < system_size; ith_qubit++) {
+    const char *start = p;
+    int pauli_encoding, binary_outcome;
+    p = scan_pauli(p, line_end, pauli_encoding);
+    if (p != NULL)
+      p = scan_int(p, line_end, binary_outcome);
+    if (p == NULL || (binary_outcome != 1 && binary_outcome != -1))
+      throw text_parse_error{start};
+
+    uint64_t *word = shot + 3 * (ith_qubit >> 6);
+    uint64_t bit = 1ULL << (ith_qubit & 63);
+    if (pauli_encoding & 1)
+      word[0] |= bit;
+    if (pauli_encoding & 2)
+      word[1] |= bit;
+    if (binary_outcome == -1)
+      word[2] |= bit;
+  }
+}
+
+//
+// 以下の関数は測定結果の行 [p, end) を解析し、空白でない行を 1 行ずつ
+// shots (stride ワードごとに 0 で初期化済み) に書き込みます。
+//
+void parse_measurement_rows(const char *p, const char *end, int system_size,
+                            uint64_t *shots) {
+  int stride = shot_stride(system_size);
+  while (p != end) {
+    const char *line_end = end_of_line(p, end);
+    if (!is_blank_line(p, line_end)) {
+      parse_measurement_row(p, line_end, system_size, shots);
+      shots += stride;
+    }
+    p = line_end == end ? end : line_end + 1;
+  }
+}
+
+void parse_measurement_line(const string &line, int system_size,
+                            uint64_t *shot) {
+  try {
+    parse_measurement_row(line.data(), line.data() + line.size(), system_size,
+                          shot);
+  } catch (const text_parse_error &) {
+    fail("測定結果の行 \"%s\" の形式が正しくありません。", line.c_str());
+  }
+}
+
+//
+// 観測量の集合
+//
+observable_set::observable_set(int system_size)
+    : system_size_(system_size), max_k_local_(0), max_qubit_(-1),
+      offsets_(1, 0) {}
+
+//
+// 1 つのチャンクから読み込んだ観測量 (CSR 形式)
+//
+struct parsed_observables {
+  vector<pair<int, int>> factors;
+  vector<int> offsets;
+  vector<double> weights;
+};
+
+//
+// 以下の関数は観測量の行 [p, end) を解析して observables に追加します。
+// 各行は "k_local pauli position ... [weight]" の形式で、重みを省略すると
+// 1 になります。
+//
+void parse_observable_rows(const char *p, const char *end,
+                           parsed_observables &observables) {
+  observables.offsets.assign(1, 0);
+  while (p != end) {
+    const char *line_end = end_of_line(p, end);
+    const char *line_start = p;
+    p = line_end == end ? end : line_end + 1;
+    if (is_blank_line(line_start, line_end))
+      continue;
+
+    const char *q = line_start;
+    int k_local;
+    q = scan_int(q, line_end, k_local);
+    if (q == NULL || k_local < 0)
+      throw text_parse_error{line_start};
+    for (int k = 0; k < k_local; k++) {
+      int pauli_encoding, position_of_pauli;
+      q = scan_pauli(q, line_end, pauli_encoding);
+      if (q != NULL)
+        q = scan_int(q, line_end, position_of_pauli);
+      if (q == NULL)
+        throw text_parse_error{line_start};
+      observables.factors.push_back(
+          make_pair(position_of_pauli, pauli_encoding));
+    }
+
+    double weight = 1.0;
+    q = skip_blanks(q, line_end);
+    if (q != line_end) {
+      char token[64];
+      size_t length = 0;
+      while (q != line_end && !is_blank(*q) && length + 1 < sizeof(token))
+        token[length++] = *q++;
+      token[length] = '\0';
+      char *token_end;
+      weight = strtod(token, &token_end);
+      if (token_end == token)
+        throw text_parse_error{line_start};
+    }
+    observables.offsets.push_back((int)observables.factors.size());
+    observables.weights.push_back(weight);
+  }
+}
+
+void observable_set::read_file(const string &observable_file_name,
+                               int number_of_threads) {
+  text_file file(observable_file_name);
+
+  // システムサイズを読み込む
+  int system_size_of_file;
+  const char *p = scan_header(observable_file_name, file, system_size_of_file);
+  if (system_size_ == -1)
+    system_size_ = system_size_of_file;
+  else if (system_size_of_file != system_size_)
+    fail("入力ファイル \"%s\" のシステムサイズ %d が %d と異なります。",
+         observable_file_name.c_str(), system_size_of_file, system_size_);
+
+  // 局所観測量をチャンクごとに並列に読み込み、ファイルの順番に追加する
+  vector<const char *> boundaries = split_into_chunks(p, file.end());
+  int number_of_chunks = (int)boundaries.size() - 1;
+  vector<parsed_observables> chunks(number_of_chunks);
+  try {
+    parallel_for(number_of_chunks, max(1, number_of_threads), [&](int c) {
+      parse_observable_rows(boundaries[c], boundaries[c + 1], chunks[c]);
+    });
+  } catch (const text_parse_error &error) {
+    fail_at(observable_file_name, file, error.position);
+  }
+
+  for (int c = 0; c < number_of_chunks; c++) {
+    const parsed_observables &chunk = chunks[c];
+    for (int i = 0; i + 1 < (int)chunk.offsets.size(); i++)
+      append(chunk.factors.data() + chunk.offsets[i],
+             chunk.offsets[i + 1] - chunk.offsets[i], chunk.weights[i]);
+  }
+}
+
+void observable_set::add(const vector<pair<int, int>> &factors,
+                         double weight) {
+  append(factors.data(), (int)factors.size(), weight);
+}
+
+void observable_set::append(const pair<int, int> *factors, int k_local,
+                            double weight) {
+  max_k_local_ = max(max_k_local_, k_local);
+  for (int k = 0; k < k_local; k++) {
+    if (factors[k].first < 0 || factors[k].second < 0 || factors[k].second > 2)
+      fail("観測量 %d の %d 番目のパウリ演算子が無効です。", size() + 1,
+           k + 1);
+    max_qubit_ = max(max_qubit_, factors[k].first);
+    factors_.push_back(factors[k]);
+  }
+  offsets_.push_back((int)factors_.size());
+  weights_.push_back(weight);
+}
+
+//
+// 以下の関数は部分系の行 [p, end) ("k_local position ...") を解析して
+// subsystems に追加します。
+//
+void parse_subsystem_rows(const char *p, const char *end,
+                          vector<vector<int>> &subsystems) {
+  while (p != end) {
+    const char *line_end = end_of_line(p, end);
+    const char *line_start = p;
+    p = line_end == end ? end : line_end + 1;
+    if (is_blank_line(line_start, line_end))
+      continue;
+
+    const char *q = line_start;
+    int k_local;
+    q = scan_int(q, line_end, k_local);
+    if (q == NULL || k_local < 0)
+      throw text_parse_error{line_start};
+    vector<int> ith_subsystem(k_local);
+    for (int k = 0; k < k_local; k++) {
+      q = scan_int(q, line_end, ith_subsystem[k]);
+      if (q == NULL)
+        throw text_parse_error{line_start};
+    }
+    subsystems.push_back(ith_subsystem);
+  }
+}
+
+vector<vector<int>> read_subsystems(const string &subsystem_file_name,
+                                    int *system_size, int number_of_threads) {
+  text_file file(subsystem_file_name);
+
+  // システムサイズを読み込む
+  int system_size_subsystem;
+  const char *p = scan_header(subsystem_file_name, file, system_size_subsystem);
+  if (system_size != NULL)
+    *system_size = system_size_subsystem;
+
+  // 部分系をチャンクごとに並列に読み込む
+  vector<const char *> boundaries = split_into_chunks(p, file.end());
+  int number_of_chunks = (int)boundaries.size() - 1;
+  vector<vector<vector<int>>> chunks(number_of_chunks);
+  try {
+    parallel_for(number_of_chunks, max(1, number_of_threads), [&](int c) {
+      parse_subsystem_rows(boundaries[c], boundaries[c + 1], chunks[c]);
+    });
+  } catch (const text_parse_error &error) {
+    fail_at(subsystem_file_name, file, error.position);
+  }
+
+  vector<vector<int>> subsystems;
+  for (int c = 0; c < number_of_chunks; c++)
+    for (vector<int> &subsystem : chunks[c])
+      subsystems.push_back(std::move(subsystem));
+  return subsystems;
+}
+
+//
+// 観測量の族
+//
+
+//
+// 以下の関数は族の引数 (正の整数) を返します。kind は "観測量" または
+// "部分系" です。
+//
+int family_parameter(const char *kind, const string &family,
+                     const string &parameter) {
+  char *end;
+  long value = strtol(parameter.c_str(), &end, 10);
+  if (parameter.empty() || *end != '\0' || value <= 0 || value > INT_MAX)
+    fail("%sの族 \"%s\" の引数が正しくありません。", kind, family.c_str());
+  return (int)value;
+}
+
+//
+// 以下の関数は qubits の上のすべてのパウリ文字列 (3^k 個) を
+// 最後の量子ビットのパウリが最も速く変わる順番に emit に渡します。
+//
+void emit_all_pauli_strings(
+    const vector<int> &qubits,
+    const function<void(const vector<pair<int, int>> &)> &emit) {
+  int k_local = (int)qubits.size();
+  vector<pair<int, int>> factors(k_local);
+  for (int k = 0; k < k_local; k++)
+    factors[k] = make_pair(qubits[k], 0);
+  for (;;) {
+    emit(factors);
+    int k = k_local - 1;
+    while (k >= 0 && factors[k].second == 2)
+      factors[k--].second = 0;
+    if (k < 0)
+      return;
+    factors[k].second++;
+  }
+}
+
+void generate_observable_family(
+    const string &family, int system_size,
+    const function<void(const vector<pair<int, int>> &)> &emit) {
+  if (system_size <= 0)
+    fail("システムサイズ %d は無効です。", system_size);
+  size_t colon = family.find(':');
+  string name = family.substr(0, colon);
+  string parameter = colon == string::npos ? "" : family.substr(colon + 1);
+  const int X = 0, Y = 1, Z = 2;
+  vector<pair<int, int>> factors;
+
+  if (name == "paper") {
+    for (int i = 0; i < system_size - 1; i++) {
+      for (int j = 0; j < system_size - 1; j++) {
+        if (j == i || j == i + 1 || j + 1 == i)
+          continue;
+        factors = {{i, Y}, {i + 1, Y}, {j, X}, {j + 1, X}};
+        emit(factors);
+      }
+    }
+    for (int i = 0; i < system_size - 1; i++) {
+      for (int j = 0; j < system_size; j++) {
+        if (j == i || j == i + 1)
+          continue;
+        for (int j2 = 0; j2 < system_size; j2++) {
+          if (j2 == i || j2 == i + 1 || j2 == j)
+            continue;
+          factors = {{i, X}, {i + 1, X}, {j, Z}, {j2, Z}};
+          emit(factors);
+        }
+      }
+    }
+    for (int i = 0; i < system_size - 1; i++) {
+      for (int j = 0; j < system_size; j++) {
+        if (j == i || j == i + 1)
+          continue;
+        factors = {{i, X}, {i + 1, X}, {j, Z}};
+        emit(factors);
+      }
+    }
+  } else if (name == "k-local") {
+    // 量子ビットの組を辞書順に巡る
+    int k_local = family_parameter("観測量", family, parameter);
+    if (k_local > system_size)
+      return;
+    vector<int> qubits(k_local);
+    for (int k = 0; k < k_local; k++)
+      qubits[k] = k;
+    for (;;) {
+      emit_all_pauli_strings(qubits, emit);
+      int k = k_local - 1;
+      while (k >= 0 && qubits[k] == system_size - k_local + k)
+        k--;
+      if (k < 0)
+        break;
+      qubits[k]++;
+      for (int l = k + 1; l < k_local; l++)
+        qubits[l] = qubits[l - 1] + 1;
+    }
+  } else if (name == "chain") {
+    int k_local = family_parameter("観測量", family, parameter);
+    vector<int> qubits(k_local);
+    for (int i = 0; i + k_local <= system_size; i++) {
+      for (int k = 0; k < k_local; k++)
+        qubits[k] = i + k;
+      emit_all_pauli_strings(qubits, emit);
+    }
+  } else if (name == "grid") {
+    int width = family_parameter("観測量", family, parameter);
+    if (system_size % width != 0)
+      fail("システムサイズ %d は格子の幅 %d で割り切れません。", system_size,
+           width);
+    int height = system_size / width;
+    vector<int> qubits(2);
+    for (int row = 0; row < height; row++) {
+      for (int column = 0; column < width; column++) {
+        int site = row * width + column;
+        qubits[0] = site;
+        if (column + 1 < width) {
+          qubits[1] = site + 1;
+          emit_all_pauli_strings(qubits, emit);
+        }
+        if (row + 1 < height) {
+          qubits[1] = site + width;
+          emit_all_pauli_strings(qubits, emit);
+        }
+      }
+    }
+  } else if (name == "pairs") {
+    bool is_all_pairs = parameter.empty();
+    if (!is_all_pairs &&
+        (parameter.size() != 2 || parameter[0] < 'X' || parameter[0] > 'Z' ||
+         parameter[1] < 'X' || parameter[1] > 'Z'))
+      fail("観測量の族 \"%s\" の引数が正しくありません。", family.c_str());
+    vector<int> qubits(2);
+    for (int i = 0; i < system_size; i++) {
+      for (int j = i + 1; j < system_size; j++) {
+        qubits[0] = i;
+        qubits[1] = j;
+        if (is_all_pairs) {
+          emit_all_pauli_strings(qubits, emit);
+          continue;
+        }
+        factors = {{i, parameter[0] - 'X'}, {j, parameter[1] - 'X'}};
+        emit(factors);
+      }
+    }
+  } else
+    fail("観測量の族 \"%s\" は無効です。", family.c_str());
+}
+
+void add_observable_family(observable_set &observables,
+                           const string &family) {
+  generate_observable_family(
+      family, observables.system_size(),
+      [&](const vector<pair<int, int>> &factors) { observables.add(factors); });
+}
+
+vector<vector<int>> generate_subsystem_family(const string &family,
+                                              int system_size) {
+  if (system_size <= 0)
+    fail("システムサイズ %d は無効です。", system_size);
+  size_t colon = family.find(':');
+  string name = family.substr(0, colon);
+  string parameter = colon == string::npos ? "" : family.substr(colon + 1);
+  vector<vector<int>> subsystems;
+
+  if (name == "chain") {
+    int length = parameter.empty()
+                     ? system_size
+                     : family_parameter("部分系", family, parameter);
+    vector<int> subsystem;
+    for (int i = 0; i < min(length, system_size); i++) {
+      subsystem.push_back(i);
+      subsystems.push_back(subsystem);
+    }
+  } else if (name == "subsets") {
+    // 大きさごとに量子ビットの組を辞書順に巡る
+    int max_size = family_parameter("部分系", family, parameter);
+    for (int size = 1; size <= min(max_size, system_size); size++) {
+      vector<int> subsystem(size);
+      for (int k = 0; k < size; k++)
+        subsystem[k] = k;
+      for (;;) {
+        subsystems.push_back(subsystem);
+        int k = size - 1;
+        while (k >= 0 && subsystem[k] == system_size - size + k)
+          k--;
+        if (k < 0)
+          break;
+        subsystem[k]++;
+        for (int l = k + 1; l < size; l++)
+          subsystem[l] = subsystem[l - 1] + 1;
+      }
+    }
+  } else
+    fail("部分系の族 \"%s\" は無効です。", family.c_str());
+  return subsystems;
+}
+
+//
+// バイナリ形式の測定ファイル:
+//   ヘッダ (32 バイト) の後に、ショットごとに shot_stride 個の uint64_t
+//   (ビットパック表現そのもの) が固定長で並びます。
+//   ファイルは mmap され、推定はマップされたページ上で直接行われます。
+//
+const char binary_measurement_magic[8] = {'S', 'H', 'A', 'D',
+                                          'O', 'W', 'B', 1};
+struct binary_measurement_header {
+  char magic[8];
+  int32_t system_size;
+  int32_t shot_stride;
+  int64_t number_of_shots;
+  int64_t reserved;
+};
+
+//
+// ショットの列
+//
+shot_batch::shot_batch(int system_size)
+    : system_size_(-1), stride_(0), number_of_shots_(0), data_(NULL),
+      mapped_(NULL), mapped_size_(0) {
+  if (system_size != -1)
+    set_system_size(system_size);
+}
+
+shot_batch::shot_batch(int system_size, const uint64_t *shots,
+                       long long number_of_shots)
+    : system_size_(-1), stride_(0), number_of_shots_(number_of_shots),
+      data_(shots), mapped_(NULL), mapped_size_(0) {
+  set_system_size(system_size);
+}
+
+shot_batch::shot_batch(shot_batch &&other)
+    : system_size_(-1), stride_(0), number_of_shots_(0), data_(NULL),
+      mapped_(NULL), mapped_size_(0) {
+  *this = std::move(other);
+}
+
+shot_batch &shot_batch::operator=(shot_batch &&other) {
+  if (this == &other)
+    return *this;
+  release();
+  bool owns_data = other.data_ == other.packed_.data();
+  system_size_ = other.system_size_;
+  stride_ = other.stride_;
+  number_of_shots_ = other.number_of_shots_;
+  packed_.swap(other.packed_);
+  data_ = owns_data ? packed_.data() : other.data_;
+  mapped_ = other.mapped_;
+  mapped_size_ = other.mapped_size_;
+  other.mapped_ = NULL;
+  other.mapped_size_ = 0;
+  other.clear();
+  return *this;
+}
+
+shot_batch::~shot_batch() { release(); }
+
+void shot_batch::release() {
+  if (mapped_ != NULL)
+    munmap(mapped_, mapped_size_);
+  mapped_ = NULL;
+  mapped_size_ = 0;
+}
+
+void shot_batch::set_system_size(int system_size) {
+  if (system_size <= 0)
+    fail("システムサイズ %d は無効です。", system_size);
+  system_size_ = system_size;
+  stride_ = shadow::shot_stride(system_size);
+}
+
+void shot_batch::clear() {
+  release();
+  packed_.clear();
+  data_ = packed_.data();
+  number_of_shots_ = 0;
+}
+
+void shot_batch::append_line(const string &line) {
+  if (data_ != packed_.data())
+    fail("mmap またはビューのショット列には追加できません。");
+  packed_.resize(packed_.size() + stride_, 0);
+  parse_measurement_line(line, system_size_,
+                         &packed_[number_of_shots_ * stride_]);
+  number_of_shots_++;
+  data_ = packed_.data();
+}
+
+void shot_batch::read_file(const string &measurement_file_name,
+                           int number_of_threads) {
+  clear();
+  if (map_binary(measurement_file_name))
+    return;
+
+  text_file file(measurement_file_name);
+
+  // システムサイズを読み込む
+  int system_size_measurement;
+  const char *p =
+      scan_header(measurement_file_name, file, system_size_measurement);
+  if (system_size_ == -1)
+    set_system_size(system_size_measurement);
+  if (system_size_measurement != system_size_)
+    fail("システムサイズが一致しません。");
+
+  // チャンクごとの行数を数えてから、各チャンクを packed_ の
+  // 対応する位置に並列に書き込む
+  vector<const char *> boundaries = split_into_chunks(p, file.end());
+  int number_of_chunks = (int)boundaries.size() - 1;
+  number_of_threads = max(1, number_of_threads);
+  vector<long long> first_shot(number_of_chunks + 1, 0);
+  parallel_for(number_of_chunks, number_of_threads, [&](int c) {
+    first_shot[c + 1] = count_nonblank_lines(boundaries[c], boundaries[c + 1]);
+  });
+  for (int c = 0; c < number_of_chunks; c++)
+    first_shot[c + 1] += first_shot[c];
+
+  packed_.assign((size_t)first_shot[number_of_chunks] * stride_, 0);
+  try {
+    parallel_for(number_of_chunks, number_of_threads, [&](int c) {
+      parse_measurement_rows(boundaries[c], boundaries[c + 1], system_size_,
+                             packed_.data() + first_shot[c] * stride_);
+    });
+  } catch (const text_parse_error &error) {
+    clear();
+    fail_at(measurement_file_name, file, error.position);
+  }
+  number_of_shots_ = first_shot[number_of_chunks];
+  data_ = packed_.data();
+}
+
+//
+// 以下の関数は measurement_file_name がバイナリ形式であれば mmap して
+// true を返します。テキスト形式 (または存在しないファイル) の場合は
+// false を返します。
+//
+bool shot_batch::map_binary(const string &measurement_file_name) {
+  int fd = open(measurement_file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  binary_measurement_header header;
+  if (read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+      memcmp(header.magic, binary_measurement_magic, 8) != 0) {
+    close(fd);
+    return false;
+  }
+
+  if (system_size_ == -1 && header.system_size > 0)
+    set_system_size(header.system_size);
+  struct stat file_status;
+  fstat(fd, &file_status);
+  long long expected_file_size =
+      (long long)sizeof(header) +
+      header.number_of_shots * stride_ * (long long)sizeof(uint64_t);
+  if (header.system_size != system_size_ || header.shot_stride != stride_ ||
+      (long long)file_status.st_size != expected_file_size) {
+    close(fd);
+    fail("バイナリファイル \"%s\" が壊れているか、"
+         "システムサイズが一致しません。",
+         measurement_file_name.c_str());
+  }
+
+  void *mapped =
+      mmap(NULL, file_status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    fail("\"%s\" を mmap できません。", measurement_file_name.c_str());
+  madvise(mapped, file_status.st_size, MADV_SEQUENTIAL);
+  mapped_ = mapped;
+  mapped_size_ = file_status.st_size;
+  number_of_shots_ = header.number_of_shots;
+  data_ = (const uint64_t *)((const char *)mapped +
+                             sizeof(binary_measurement_header));
+  return true;
+}
+
+//
+// 以下の関数はショットの列をバイナリ形式で
+// ファイル: binary_file_name に書き出します。
+//
+void shot_batch::write_binary(const string &binary_file_name) const {
+  FILE *binary_file = fopen(binary_file_name.c_str(), "wb");
+  if (binary_file == NULL)
+    fail("出力ファイル \"%s\" を作成できません。", binary_file_name.c_str());
+
+  binary_measurement_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, binary_measurement_magic, 8);
+  header.system_size = system_size_;
+  header.shot_stride = stride_;
+  header.number_of_shots = number_of_shots_;
+
+  size_t number_of_words = (size_t)number_of_shots_ * stride_;
+  bool failed =
+      fwrite(&header, sizeof(header), 1, binary_file) != 1 ||
+      fwrite(data_, sizeof(uint64_t), number_of_words, binary_file) !=
+          number_of_words;
+  fclose(binary_file);
+  if (failed)
+    fail("\"%s\" への書き込みに失敗しました。", binary_file_name.c_str());
+}
+
+//
+// 測定ファイルの逐次的な読み込み:
+//   ワーカーはチャンクを番号の順に取り、window 個より先のチャンクは
+//   消費されるまで解析しません。next はチャンクを番号の順に待って返し、
+//   前に返したチャンクのメモリを解放します。
+//
+struct measurement_reader::pipeline {
+  string file_name;
+  shot_batch binary;
+  bool is_binary;
+  bool binary_returned;
+  unique_ptr<text_file> file;
+  int system_size;
+  vector<const char *> boundaries;
+  int number_of_chunks;
+
+  vector<vector<uint64_t>> chunk_shots;
+  vector<long long> chunk_size;
+  vector<exception_ptr> chunk_error;
+  vector<char> chunk_ready;
+  int next_chunk_to_parse;
+  int next_chunk_to_consume;
+  int window;
+  bool stopping;
+  mutex lock;
+  condition_variable parsed;
+  condition_variable consumed;
+  vector<thread> workers;
+
+  void work() {
+    for (;;) {
+      int c;
+      {
+        unique_lock<mutex> guard(lock);
+        consumed.wait(guard, [&]() {
+          return stopping || next_chunk_to_parse >= number_of_chunks ||
+                 next_chunk_to_parse < next_chunk_to_consume + window;
+        });
+        if (stopping || next_chunk_to_parse >= number_of_chunks)
+          return;
+        c = next_chunk_to_parse++;
+      }
+      try {
+        long long number_of_shots =
+            count_nonblank_lines(boundaries[c], boundaries[c + 1]);
+        chunk_shots[c].assign(
+            (size_t)number_of_shots * shot_stride(system_size), 0);
+        parse_measurement_rows(boundaries[c], boundaries[c + 1], system_size,
+                               chunk_shots[c].data());
+        chunk_size[c] = number_of_shots;
+      } catch (...) {
+        chunk_error[c] = current_exception();
+      }
+      {
+        lock_guard<mutex> guard(lock);
+        chunk_ready[c] = 1;
+      }
+      parsed.notify_all();
+    }
+  }
+};
+
+//
+// 以下の関数は measurement_file_name がバイナリ形式のファイルであれば
+// true を返します。
+//
+bool is_binary_measurement_file(const string &measurement_file_name) {
+  int fd = open(measurement_file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  char magic[8];
+  bool is_binary = read(fd, magic, 8) == 8 &&
+                   memcmp(magic, binary_measurement_magic, 8) == 0;
+  close(fd);
+  return is_binary;
+}
+
+measurement_reader::measurement_reader(const string &measurement_file_name,
+                                       int number_of_threads)
+    : pipeline_(new pipeline) {
+  pipeline &p = *pipeline_;
+  p.file_name = measurement_file_name;
+  p.is_binary = is_binary_measurement_file(measurement_file_name);
+  p.binary_returned = false;
+  p.number_of_chunks = 0;
+  p.next_chunk_to_parse = 0;
+  p.next_chunk_to_consume = 0;
+  p.stopping = false;
+  try {
+    if (p.is_binary) {
+      p.binary.read_file(measurement_file_name);
+      p.system_size = p.binary.system_size();
+      return;
+    }
+
+    // システムサイズを読み込む
+    p.file.reset(new text_file(measurement_file_name));
+    const char *after_header =
+        scan_header(measurement_file_name, *p.file, p.system_size);
+    if (p.system_size <= 0)
+      fail("システムサイズ %d は無効です。", p.system_size);
+
+    p.boundaries = split_into_chunks(after_header, p.file->end());
+    p.number_of_chunks = (int)p.boundaries.size() - 1;
+    p.chunk_shots.resize(p.number_of_chunks);
+    p.chunk_size.assign(p.number_of_chunks, 0);
+    p.chunk_error.resize(p.number_of_chunks);
+    p.chunk_ready.assign(p.number_of_chunks, 0);
+    int number_of_workers = max(1, number_of_threads);
+    p.window = 2 * number_of_workers;
+    for (int i = 0; i < min(number_of_workers, p.number_of_chunks); i++)
+      p.workers.push_back(thread(&pipeline::work, &p));
+  } catch (...) {
+    delete pipeline_;
+    throw;
+  }
+}
+
+measurement_reader::~measurement_reader() {
+  {
+    lock_guard<mutex> guard(pipeline_->lock);
+    pipeline_->stopping = true;
+  }
+  pipeline_->consumed.notify_all();
+  for (thread &worker : pipeline_->workers)
+    worker.join();
+  delete pipeline_;
+}
+
+int measurement_reader::system_size() const { return pipeline_->system_size; }
+
+bool measurement_reader::next(const uint64_t *&shots,
+                              long long &number_of_shots) {
+  pipeline &p = *pipeline_;
+  if (p.is_binary) {
+    if (p.binary_returned)
+      return false;
+    p.binary_returned = true;
+    shots = p.binary.data();
+    number_of_shots = p.binary.size();
+    return true;
+  }
+
+  unique_lock<mutex> guard(p.lock);
+  if (p.next_chunk_to_consume > 0)
+    vector<uint64_t>().swap(p.chunk_shots[p.next_chunk_to_consume - 1]);
+  if (p.next_chunk_to_consume >= p.number_of_chunks)
+    return false;
+  int c = p.next_chunk_to_consume;
+  p.parsed.wait(guard, [&]() { return p.chunk_ready[c] != 0; });
+  p.next_chunk_to_consume++;
+  guard.unlock();
+  p.consumed.notify_all();
+
+  if (p.chunk_error[c]) {
+    try {
+      rethrow_exception(p.chunk_error[c]);
+    } catch (const text_parse_error &error) {
+      fail_at(p.file_name, *p.file, error.position);
+    }
+  }
+  shots = p.chunk_shots[c].data();
+  number_of_shots = p.chunk_size[c];
+  return true;
+}
+
+//
+// 64 ビットワード x の 1 のビットの数を返します。
+// popcnt 命令がない場合でもベクトル化できるようにビット演算で数えます。
+//
+inline uint64_t popcount_of_word(uint64_t x) {
+#ifdef __POPCNT__
+  return __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  x += x >> 8;
+  x += x >> 16;
+  x += x >> 32;
+  return x & 0x7F;
+#endif
+}
+
+//
+// 以下の関数は 64 x 64 のビット行列を転置します
+// (a[j] のビット i と a[i] のビット j を入れ替えます)。
+//
+inline void transpose_bit_matrix(uint64_t a[64]) {
+  uint64_t mask = 0x00000000FFFFFFFFULL;
+  for (int j = 32; j != 0; j >>= 1, mask ^= mask << j) {
+    for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+      uint64_t t = ((a[k] >> j) ^ a[k | j]) & mask;
+      a[k | j] ^= t;
+      a[k] ^= t << j;
+    }
+  }
+}
+
+//
+// 観測量のトライによる累積:
+//   ショットは shot_tile_size 個ずつ処理します。各ノードでは、親のノードまで
+//   すべての因子の基底が一致したショットの番号 (と測定結果のパリティ) の
+//   リストから、このノードの因子の基底も一致するものを取り出します。
+//   共有された接頭辞は 1 回しか評価されず、一致するショットがなくなった
+//   部分木はまとめて読み飛ばされます。
+//
+//   同じ測定設定を繰り返したデータでは、タイルの中に基底がまったく同じ
+//   ショットが並びます。そのようなタイルでは基底をハッシュして最大
+//   max_shots_per_group 個ずつの組にまとめ、基底の照合は組ごとに 1 回だけ
+//   行います。組の測定結果は量子ビットごとのビット列 (ビット s が組の
+//   s 番目のショット) に転置しておくので、パリティは組ごとに 64 ビットの
+//   XOR で、-1 の数は popcount で求まります。
+//
+//   number_of_batches > 1 のとき、累積値 a のバッチ b は
+//   a * number_of_batches + b 番目です。
+//
+const int shot_tile_size = 256;
+const int max_shots_per_group = 64;
+const int max_groups_per_tile = shot_tile_size / 8; // これより多ければ組にしない
+const int group_hash_bits = 9;
+
+class observable_trie_walker {
+public:
+  observable_trie_walker(const vector<observable_trie_node> &trie, int stride,
+                         int number_of_batches, int *number_of_measurements,
+                         int *sum_of_measurement_results)
+      : trie_(trie), stride_(stride), number_of_words_(stride / 3),
+        number_of_batches_(number_of_batches),
+        number_of_measurements_(number_of_measurements),
+        sum_of_measurement_results_(sum_of_measurement_results),
+        max_depth_(0), batch_of_shot_(shot_tile_size, 0),
+        group_of_slot_(1 << group_hash_bits),
+        group_first_shot_(max_groups_per_tile),
+        group_size_(max_groups_per_tile),
+        group_members_(max_groups_per_tile * max_shots_per_group),
+        group_outcomes_((size_t)max_groups_per_tile * number_of_words_ * 64),
+        number_of_groups_(0) {
+    for (int n = 0; n < (int)trie.size(); n++)
+      max_depth_ = max(max_depth_, trie[n].depth);
+    matched_.resize((size_t)(max_depth_ + 1) * shot_tile_size);
+    parity_.resize((size_t)(max_depth_ + 1) * shot_tile_size);
+    matched_groups_.resize((size_t)(max_depth_ + 1) * max_groups_per_tile);
+    group_parity_.resize((size_t)(max_depth_ + 1) * max_groups_per_tile);
+    number_matched_.resize(max_depth_ + 1);
+  }
+
+  //
+  // 以下の関数はタイル (tile_length 個のショット) を累積します。
+  // タイルの先頭のショットは first_shot_index 番目として数えます。
+  //
+  void add_tile(const uint64_t *tile, int tile_length,
+                long long first_shot_index) {
+    if (number_of_batches_ > 1) {
+      int first_batch = (int)(first_shot_index % number_of_batches_);
+      for (int u = 0; u < tile_length; u++)
+        batch_of_shot_[u] = (first_batch + u) % number_of_batches_;
+    }
+    if (group_shots(tile, tile_length))
+      walk_groups(tile, tile_length);
+    else
+      walk_shots(tile, tile_length);
+  }
+
+private:
+  //
+  // 以下の関数はタイルのショットを基底ごとの組にまとめます。組が
+  // max_groups_per_tile 個を超える (繰り返しが少ない) 場合は false を
+  // 返します。
+  //
+  bool group_shots(const uint64_t *tile, int tile_length) {
+    fill(group_of_slot_.begin(), group_of_slot_.end(), -1);
+    number_of_groups_ = 0;
+    int slot_mask = (1 << group_hash_bits) - 1;
+    for (int u = 0; u < tile_length; u++) {
+      const uint64_t *shot = tile + (long long)u * stride_;
+      uint64_t hash = 0;
+      for (int w = 0; w < number_of_words_; w++) {
+        hash = (hash ^ shot[3 * w]) * 0x9E3779B97F4A7C15ULL;
+        hash = (hash ^ shot[3 * w + 1]) * 0x9E3779B97F4A7C15ULL;
+      }
+      int slot = (int)(hash >> (64 - group_hash_bits));
+      int group;
+      while ((group = group_of_slot_[slot]) >= 0 &&
+             !has_same_basis(shot, tile + (long long)group_first_shot_[group] *
+                                              stride_))
+        slot = (slot + 1) & slot_mask;
+
+      if (group < 0 || group_size_[group] == max_shots_per_group) {
+        if (number_of_groups_ == max_groups_per_tile)
+          return false;
+        group = number_of_groups_++;
+        group_first_shot_[group] = u;
+        group_size_[group] = 0;
+        group_of_slot_[slot] = group;
+      }
+      group_members_[group * max_shots_per_group + group_size_[group]++] =
+          (uint16_t)u;
+    }
+
+    // 組の測定結果を量子ビットごとのビット列に転置する
+    uint64_t rows[64];
+    for (int group = 0; group < number_of_groups_; group++) {
+      for (int w = 0; w < number_of_words_; w++) {
+        for (int s = 0; s < 64; s++)
+          rows[s] = s < group_size_[group]
+                        ? tile[(long long)group_members_[group *
+                                                         max_shots_per_group +
+                                                         s] *
+                                   stride_ +
+                               3 * w + 2]
+                        : 0;
+        transpose_bit_matrix(rows);
+        copy(rows, rows + 64,
+             &group_outcomes_[((size_t)group * number_of_words_ + w) * 64]);
+      }
+    }
+    return true;
+  }
+
+  bool has_same_basis(const uint64_t *shot, const uint64_t *other) const {
+    for (int w = 0; w < number_of_words_; w++)
+      if (shot[3 * w] != other[3 * w] || shot[3 * w + 1] != other[3 * w + 1])
+        return false;
+    return true;
+  }
+
+  //
+  // 以下の関数は一致した count 個のショットの測定結果をバッチごとに
+  // 累積値 accumulator に加算します。
+  //
+  void add_to_batches(int accumulator, const uint16_t *matched_shots,
+                      const uint8_t *matched_parity, int count) {
+    int *measurements =
+        number_of_measurements_ + accumulator * number_of_batches_;
+    int *sums = sum_of_measurement_results_ + accumulator * number_of_batches_;
+    for (int i = 0; i < count; i++) {
+      int batch = batch_of_shot_[matched_shots[i]];
+      measurements[batch]++;
+      sums[batch] += 1 - 2 * matched_parity[i];
+    }
+  }
+
+  void add_group_to_batches(int accumulator, int group, uint64_t parity) {
+    int *measurements =
+        number_of_measurements_ + accumulator * number_of_batches_;
+    int *sums = sum_of_measurement_results_ + accumulator * number_of_batches_;
+    for (int s = 0; s < group_size_[group]; s++) {
+      int batch =
+          batch_of_shot_[group_members_[group * max_shots_per_group + s]];
+      measurements[batch]++;
+      sums[batch] += 1 - 2 * (int)((parity >> s) & 1);
+    }
+  }
+
+  //
+  // 以下の関数はショットごとにトライをたどります。
+  //
+  void walk_shots(const uint64_t *tile, int tile_length) {
+    // 根 (因子のない観測量) ではすべてのショットが一致する
+    for (int u = 0; u < tile_length; u++) {
+      matched_[u] = (uint16_t)u;
+      parity_[u] = 0;
+    }
+    number_matched_[0] = tile_length;
+    if (trie_[0].accumulator >= 0)
+      add_to_accumulator(trie_[0].accumulator, &matched_[0], &parity_[0],
+                         tile_length, 0);
+
+    int number_of_nodes = (int)trie_.size();
+    for (int n = 1; n < number_of_nodes;) {
+      const observable_trie_node &node = trie_[n];
+      const uint16_t *parent_matched =
+          &matched_[(node.depth - 1) * shot_tile_size];
+      const uint8_t *parent_parity =
+          &parity_[(node.depth - 1) * shot_tile_size];
+      uint16_t *node_matched = &matched_[node.depth * shot_tile_size];
+      uint8_t *node_parity = &parity_[node.depth * shot_tile_size];
+      int word_offset = 3 * (node.qubit >> 6), bit = node.qubit & 63;
+
+      // 分岐を避けるため、一致しないショットも書き込んでから上書きする
+      int count = 0, odd_parity = 0;
+      for (int i = 0; i < number_matched_[node.depth - 1]; i++) {
+        int u = parent_matched[i];
+        const uint64_t *word = tile + (long long)u * stride_ + word_offset;
+        int pauli =
+            (int)(((word[0] >> bit) & 1) | (((word[1] >> bit) & 1) << 1));
+        uint8_t outcome_parity =
+            parent_parity[i] ^ (uint8_t)((word[2] >> bit) & node.outcome);
+        node_matched[count] = (uint16_t)u;
+        node_parity[count] = outcome_parity;
+        int is_matched = pauli == node.pauli;
+        odd_parity += is_matched & outcome_parity;
+        count += is_matched;
+      }
+      number_matched_[node.depth] = count;
+
+      if (count == 0) {
+        n = node.subtree_end;
+        continue;
+      }
+      if (node.accumulator >= 0)
+        add_to_accumulator(node.accumulator, node_matched, node_parity, count,
+                           odd_parity);
+      n++;
+    }
+  }
+
+  void add_to_accumulator(int accumulator, const uint16_t *matched_shots,
+                          const uint8_t *matched_parity, int count,
+                          int odd_parity) {
+    if (number_of_batches_ > 1) {
+      add_to_batches(accumulator, matched_shots, matched_parity, count);
+      return;
+    }
+    number_of_measurements_[accumulator] += count;
+    sum_of_measurement_results_[accumulator] += count - 2 * odd_parity;
+  }
+
+  //
+  // 以下の関数は基底の組ごとにトライをたどります。
+  //
+  void walk_groups(const uint64_t *tile, int tile_length) {
+    for (int group = 0; group < number_of_groups_; group++) {
+      matched_groups_[group] = (uint8_t)group;
+      group_parity_[group] = 0;
+    }
+    number_matched_[0] = number_of_groups_;
+    if (trie_[0].accumulator >= 0)
+      add_groups_to_accumulator(trie_[0].accumulator, &matched_groups_[0],
+                                &group_parity_[0], number_of_groups_,
+                                tile_length, 0);
+
+    int number_of_nodes = (int)trie_.size();
+    for (int n = 1; n < number_of_nodes;) {
+      const observable_trie_node &node = trie_[n];
+      const uint8_t *parent_matched =
+          &matched_groups_[(node.depth - 1) * max_groups_per_tile];
+      const uint64_t *parent_parity =
+          &group_parity_[(node.depth - 1) * max_groups_per_tile];
+      uint8_t *node_matched =
+          &matched_groups_[node.depth * max_groups_per_tile];
+      uint64_t *node_parity = &group_parity_[node.depth * max_groups_per_tile];
+      int word_offset = 3 * (node.qubit >> 6), bit = node.qubit & 63;
+      size_t outcome_offset = (size_t)(node.qubit >> 6) * 64 + bit;
+      uint64_t outcome_mask = 0 - (uint64_t)node.outcome;
+
+      int count = 0, number_of_shots = 0, odd_parity = 0;
+      for (int i = 0; i < number_matched_[node.depth - 1]; i++) {
+        int group = parent_matched[i];
+        const uint64_t *word = tile +
+                               (long long)group_first_shot_[group] * stride_ +
+                               word_offset;
+        int pauli =
+            (int)(((word[0] >> bit) & 1) | (((word[1] >> bit) & 1) << 1));
+        uint64_t outcome_parity =
+            parent_parity[i] ^
+            (group_outcomes_[(size_t)group * number_of_words_ * 64 +
+                             outcome_offset] &
+             outcome_mask);
+        node_matched[count] = (uint8_t)group;
+        node_parity[count] = outcome_parity;
+        int is_matched = pauli == node.pauli;
+        number_of_shots += is_matched * group_size_[group];
+        odd_parity += is_matched * (int)popcount_of_word(outcome_parity);
+        count += is_matched;
+      }
+      number_matched_[node.depth] = count;
+
+      if (count == 0) {
+        n = node.subtree_end;
+        continue;
+      }
+      if (node.accumulator >= 0)
+        add_groups_to_accumulator(node.accumulator, node_matched, node_parity,
+                                  count, number_of_shots, odd_parity);
+      n++;
+    }
+  }
+
+  void add_groups_to_accumulator(int accumulator, const uint8_t *groups,
+                                 const uint64_t *parities, int count,
+                                 int number_of_shots, int odd_parity) {
+    if (number_of_batches_ > 1) {
+      for (int i = 0; i < count; i++)
+        add_group_to_batches(accumulator, groups[i], parities[i]);
+      return;
+    }
+    number_of_measurements_[accumulator] += number_of_shots;
+    sum_of_measurement_results_[accumulator] +=
+        number_of_shots - 2 * odd_parity;
+  }
+
+  const vector<observable_trie_node> &trie_;
+  int stride_;
+  int number_of_words_;
+  int number_of_batches_;
+  int *number_of_measurements_;
+  int *sum_of_measurement_results_;
+  int max_depth_;
+  vector<int> batch_of_shot_;
+
+  // ショットごとにたどる場合の、深さ d のノードで基底が一致したショットの
+  // 番号とパリティ
+  vector<uint16_t> matched_;
+  vector<uint8_t> parity_;
+  vector<int> number_matched_;
+
+  // 基底の組
+  vector<int> group_of_slot_; // ハッシュ表
+  vector<int> group_first_shot_;
+  vector<int> group_size_;
+  vector<uint16_t> group_members_;
+  vector<uint64_t> group_outcomes_; // (組, ワード, ビット) ごとのビット列
+  int number_of_groups_;
+  vector<uint8_t> matched_groups_;
+  vector<uint64_t> group_parity_;
+};
+
+//
+// 以下の関数はショット列 shots (number_of_shots_to_scan 個) を走査し、
+// 観測量のトライの各累積値に測定回数と測定結果の合計を加算します。
+// shots の先頭のショットは first_shot_index 番目として数えます。
+//
+void accumulate_observable_trie(const vector<observable_trie_node> &trie,
+                                int stride, const uint64_t *shots,
+                                long long number_of_shots_to_scan,
+                                long long first_shot_index,
+                                int number_of_batches,
+                                int *number_of_measurements,
+                                int *sum_of_measurement_results) {
+  observable_trie_walker walker(trie, stride, number_of_batches,
+                                number_of_measurements,
+                                sum_of_measurement_results);
+  for (long long tile_begin = 0; tile_begin < number_of_shots_to_scan;
+       tile_begin += shot_tile_size) {
+    int tile_length = (int)min((long long)shot_tile_size,
+                               number_of_shots_to_scan - tile_begin);
+    walker.add_tile(shots + tile_begin * stride, tile_length,
+                    first_shot_index + tile_begin);
+  }
+}
+
+//
+// 以下の関数は観測量の集合のトライを作ります。accumulator_of_observable には
+// 各観測量の累積値の番号を書き込み、累積値の数を返します。
+//
+int build_observable_trie(const observable_set &observables,
+                          vector<observable_trie_node> &trie,
+                          vector<int> &accumulator_of_observable) {
+  // 子は (量子ビット, パウリ) ごとに 1 つ
+  vector<map<pair<int, int>, int>> children(1);
+  vector<pair<int, int>> node_factor(1, make_pair(-1, -1));
+  vector<int> node_accumulator(1, -1);
+  map<vector<pair<int, int>>, int> accumulator_of_factors;
+
+  const vector<pair<int, int>> &factors = observables.factors();
+  accumulator_of_observable.assign(observables.size(), -1);
+  vector<pair<int, int>> path;
+  for (int i = 0; i < observables.size(); i++) {
+    // 同じ量子ビットに作用する因子をまとめる (最初に現れた順番)。
+    // path の第 2 成分は pauli + 4 * (因子の数が偶数なら 1)
+    path.clear();
+    for (int f = observables.offset(i); f < observables.offset(i + 1); f++) {
+      int j = 0;
+      while (j < (int)path.size() && path[j].first != factors[f].first)
+        j++;
+      if (j == (int)path.size()) {
+        path.push_back(factors[f]);
+        continue;
+      }
+      int pauli = path[j].second & 3, even = path[j].second >> 2;
+      if (pauli != factors[f].second)
+        pauli = 3; // 異なるパウリ: どの基底とも一致しない
+      path[j].second = pauli + 4 * (1 - even);
+    }
+
+    // 因子の順番によらない観測量の鍵で重複を除く
+    vector<pair<int, int>> key = path;
+    sort(key.begin(), key.end());
+    map<vector<pair<int, int>>, int>::iterator found =
+        accumulator_of_factors.find(key);
+    if (found != accumulator_of_factors.end()) {
+      accumulator_of_observable[i] = found->second;
+      continue;
+    }
+    int accumulator = (int)accumulator_of_factors.size();
+    accumulator_of_factors[key] = accumulator;
+    accumulator_of_observable[i] = accumulator;
+
+    int node = 0;
+    for (int k = 0; k < (int)path.size(); k++) {
+      map<pair<int, int>, int>::iterator child = children[node].find(path[k]);
+      if (child != children[node].end()) {
+        node = child->second;
+        continue;
+      }
+      int new_node = (int)children.size();
+      children[node][path[k]] = new_node;
+      children.push_back(map<pair<int, int>, int>());
+      node_factor.push_back(path[k]);
+      node_accumulator.push_back(-1);
+      node = new_node;
+    }
+    node_accumulator[node] = accumulator;
+  }
+
+  // 前順に並べる
+  trie.clear();
+  vector<pair<int, int>> stack(1, make_pair(0, 0)); // (ノード, 深さ)
+  vector<int> position_in_trie(children.size());
+  vector<int> preorder;
+  while (!stack.empty()) {
+    int node = stack.back().first, depth = stack.back().second;
+    stack.pop_back();
+    position_in_trie[node] = (int)trie.size();
+    preorder.push_back(node);
+    int code = node_factor[node].second; // 根は -1
+    observable_trie_node trie_node = {
+        node_factor[node].first, node == 0 ? -1 : code & 3,
+        node == 0 ? 0 : 1 - (code >> 2), depth, 0, node_accumulator[node]};
+    trie.push_back(trie_node);
+    for (map<pair<int, int>, int>::reverse_iterator child =
+             children[node].rbegin();
+         child != children[node].rend(); child++)
+      stack.push_back(make_pair(child->second, depth + 1));
+  }
+  // 部分木の終わりは、後ろから子の部分木の終わりの最大値を取って求める
+  for (int p = (int)trie.size() - 1; p >= 0; p--) {
+    int subtree_end = p + 1;
+    for (map<pair<int, int>, int>::iterator child =
+             children[preorder[p]].begin();
+         child != children[preorder[p]].end(); child++)
+      subtree_end =
+          max(subtree_end, trie[position_in_trie[child->second]].subtree_end);
+    trie[p].subtree_end = subtree_end;
+  }
+  return (int)accumulator_of_factors.size();
+}
+
+//
+// 局所観測量の予測
+//
+observable_predictor::observable_predictor(const observable_set &observables,
+                                           int system_size,
+                                           int number_of_threads,
+                                           int number_of_batches)
+    : stride_(shadow::shot_stride(system_size)),
+      number_of_threads_(max(1, number_of_threads)),
+      number_of_batches_(number_of_batches), number_of_shots_added_(0) {
+  if (number_of_batches < 1)
+    fail("バッチの数 %d は無効です。", number_of_batches);
+  if (observables.max_qubit() >= system_size)
+    fail("観測量が作用する量子ビット %d がシステムサイズ %d を超えています。",
+         observables.max_qubit(), system_size);
+  int number_of_accumulators =
+      build_observable_trie(observables, trie_, accumulator_of_observable_);
+  number_of_measurements_.assign(
+      (size_t)number_of_accumulators * number_of_batches, 0);
+  sum_of_measurement_results_.assign(
+      (size_t)number_of_accumulators * number_of_batches, 0);
+}
+
+void observable_predictor::reset() {
+  fill(number_of_measurements_.begin(), number_of_measurements_.end(), 0);
+  fill(sum_of_measurement_results_.begin(), sum_of_measurement_results_.end(),
+       0);
+  number_of_shots_added_ = 0;
+}
+
+int observable_predictor::number_of_measurements(int i) const {
+  int total = 0;
+  for (int batch = 0; batch < number_of_batches_; batch++)
+    total += number_of_measurements(i, batch);
+  return total;
+}
+
+int observable_predictor::sum_of_measurement_results(int i) const {
+  int total = 0;
+  for (int batch = 0; batch < number_of_batches_; batch++)
+    total += sum_of_measurement_results(i, batch);
+  return total;
+}
+
+double observable_predictor::estimate(int i) const {
+  if (number_of_measurements(i) == 0)
+    return 0;
+  return 1.0 * sum_of_measurement_results(i) / number_of_measurements(i);
+}
+
+//
+// 以下の関数は i 番目の観測量の中央値平均を返します。
+// 予測値は測定されたバッチの平均の中央値 (バッチが偶数個なら中央の 2 つの
+// 平均) です。分散はバッチの平均の不偏分散をバッチの数で割ったもの
+// (全体の平均の分散の推定値) で、測定されたバッチが 2 個未満のときは
+// +1/-1 の測定結果の分散 (1 - 平均^2) を測定回数で割ったものを使います。
+// 信頼区間は予測値 ± 1.96 * sqrt(分散) を [-1, 1] に制限したものです。
+//
+median_of_means_estimate observable_predictor::median_of_means(int i) const {
+  vector<double> batch_means;
+  for (int batch = 0; batch < number_of_batches_; batch++) {
+    if (number_of_measurements(i, batch) > 0)
+      batch_means.push_back(1.0 * sum_of_measurement_results(i, batch) /
+                            number_of_measurements(i, batch));
+  }
+  median_of_means_estimate result = {0, 0, 0, 0};
+  int number_of_means = (int)batch_means.size();
+  if (number_of_means == 0)
+    return result;
+
+  sort(batch_means.begin(), batch_means.end());
+  result.estimate = number_of_means % 2 == 1
+                        ? batch_means[number_of_means / 2]
+                        : 0.5 * (batch_means[number_of_means / 2 - 1] +
+                                 batch_means[number_of_means / 2]);
+  if (number_of_means >= 2) {
+    double mean = 0, sum_of_squares = 0;
+    for (double batch_mean : batch_means)
+      mean += batch_mean / number_of_means;
+    for (double batch_mean : batch_means)
+      sum_of_squares += (batch_mean - mean) * (batch_mean - mean);
+    result.variance = sum_of_squares / (number_of_means - 1) / number_of_means;
+  } else {
+    double mean = estimate(i);
+    result.variance = (1 - mean * mean) / number_of_measurements(i);
+  }
+  double half_width = 1.96 * sqrt(result.variance);
+  result.lower = max(-1.0, result.estimate - half_width);
+  result.upper = min(1.0, result.estimate + half_width);
+  return result;
+}
+
+void observable_predictor::add_shots(const shot_batch &shots) {
+  if (shots.stride() != stride_)
+    fail("システムサイズが一致しません。");
+  add_shots(shots.data(), shots.size());
+}
+
+//
+// 以下の関数は accumulate_observable_trie をショットの区間ごとに
+// number_of_threads 個のスレッドで実行します。各スレッドは自分専用の
+// 配列に加算し、最後にそれらを足し合わせます。
+// 加算はすべて整数で行われるので、結果はスレッド数によらず同一です。
+//
+void observable_predictor::add_shots(const uint64_t *shots,
+                                     long long number_of_shots_to_scan) {
+  long long shots_per_thread =
+      (number_of_shots_to_scan + number_of_threads_ - 1) / number_of_threads_;
+  shots_per_thread =
+      (shots_per_thread + shot_tile_size - 1) / shot_tile_size * shot_tile_size;
+  int number_of_shards =
+      shots_per_thread == 0
+          ? 0
+          : (int)((number_of_shots_to_scan + shots_per_thread - 1) /
+                  shots_per_thread);
+  if (number_of_shards <= 1) {
+    accumulate_observable_trie(trie_, stride_, shots, number_of_shots_to_scan,
+                               number_of_shots_added_, number_of_batches_,
+                               number_of_measurements_.data(),
+                               sum_of_measurement_results_.data());
+    number_of_shots_added_ += number_of_shots_to_scan;
+    return;
+  }
+
+  vector<vector<int>> shard_number_of_measurements(
+      number_of_shards, vector<int>(number_of_measurements_.size(), 0));
+  vector<vector<int>> shard_sum_of_measurement_results(
+      number_of_shards, vector<int>(number_of_measurements_.size(), 0));
+  vector<thread> workers;
+  for (int shard = 0; shard < number_of_shards; shard++) {
+    long long first_shot = shard * shots_per_thread;
+    long long shard_length =
+        min(shots_per_thread, number_of_shots_to_scan - first_shot);
+    workers.push_back(thread(accumulate_observable_trie, cref(trie_), stride_,
+                             shots + first_shot * stride_, shard_length,
+                             number_of_shots_added_ + first_shot,
+                             number_of_batches_,
+                             shard_number_of_measurements[shard].data(),
+                             shard_sum_of_measurement_results[shard].data()));
+  }
+  for (int shard = 0; shard < number_of_shards; shard++)
+    workers[shard].join();
+  number_of_shots_added_ += number_of_shots_to_scan;
+
+  for (int shard = 0; shard < number_of_shards; shard++) {
+    for (size_t a = 0; a < number_of_measurements_.size(); a++) {
+      number_of_measurements_[a] += shard_number_of_measurements[shard][a];
+      sum_of_measurement_results_[a] +=
+          shard_sum_of_measurement_results[shard][a];
+    }
+  }
+}
+
+//
+// すべての 2 点相関の予測:
+//   ショットは correlation_block_shots 個ずつ、量子ビット q ごとに 4 本の
+//   ビット列 (行) に転置されます。行 r = 0, 1, 2 はショットの基底が
+//   X, Y, Z であること、行 3 は測定結果が -1 であることを表します。
+//   (i, P, j, Q) の測定回数は popcount(A_iP & A_jQ) で、測定結果の積が -1
+//   だった回数は popcount(A_iP & A_jQ & (O_i ^ O_j)) です。
+//
+//   量子ビットの組は correlation_tile_qubits 個四方のタイルに分けられ、
+//   タイルごとにスレッドに割り当てられます。タイルの中では行を
+//   correlation_tile_words 語ずつ区切って走査するので、タイルの行は
+//   キャッシュに収まったまま 9 通りの組み合わせすべてに使われます。
+//   i < j のタイルだけを計算し、(j, Q, i, P) には同じ値を書き込みます。
+//
+const int correlation_tile_qubits = 16;
+const int correlation_tile_words = 256;
+
+//
+// 以下の関数は量子ビット i, j の行 (row_i, row_j) の語 [w_begin, w_end) に
+// ついて、9 通りの (P, Q) の測定回数を count に、測定結果の積が -1 だった
+// 回数を odd に加えます。popcnt 命令がない場合は、語ごとの popcount を
+// バイトごとの個数 (0 から 8) のまま最大 31 語分足し合わせてから、
+// まとめてバイトの和を取ります。
+//
+inline uint64_t byte_popcounts_of_word(uint64_t x) {
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  return (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+}
+
+inline int sum_of_bytes(uint64_t x) {
+  x = (x & 0x00FF00FF00FF00FFULL) + ((x >> 8) & 0x00FF00FF00FF00FFULL);
+  x += x >> 16;
+  x += x >> 32;
+  return (int)(x & 0xFFFF);
+}
+
+void correlate_pair(const uint64_t *row_i, const uint64_t *row_j,
+                    long long words_per_row, long long w_begin,
+                    long long w_end, int *count, int *odd) {
+  const uint64_t *outcome_i = row_i + 3 * words_per_row;
+  const uint64_t *outcome_j = row_j + 3 * words_per_row;
+#ifdef __POPCNT__
+  for (long long w = w_begin; w < w_end; w++) {
+    uint64_t differ = outcome_i[w] ^ outcome_j[w];
+    for (int P = 0; P < 3; P++) {
+      uint64_t a = row_i[P * words_per_row + w];
+      for (int Q = 0; Q < 3; Q++) {
+        uint64_t both = a & row_j[Q * words_per_row + w];
+        count[3 * P + Q] += (int)popcount_of_word(both);
+        odd[3 * P + Q] += (int)popcount_of_word(both & differ);
+      }
+    }
+  }
+#else
+  for (long long first = w_begin; first < w_end; first += 31) {
+    long long last = min(w_end, first + 31);
+    uint64_t count_bytes[9] = {0}, odd_bytes[9] = {0};
+    for (long long w = first; w < last; w++) {
+      uint64_t differ = outcome_i[w] ^ outcome_j[w];
+      for (int P = 0; P < 3; P++) {
+        uint64_t a = row_i[P * words_per_row + w];
+        for (int Q = 0; Q < 3; Q++) {
+          uint64_t both = a & row_j[Q * words_per_row + w];
+          count_bytes[3 * P + Q] += byte_popcounts_of_word(both);
+          odd_bytes[3 * P + Q] += byte_popcounts_of_word(both & differ);
+        }
+      }
+    }
+    for (int c = 0; c < 9; c++) {
+      count[c] += sum_of_bytes(count_bytes[c]);
+      odd[c] += sum_of_bytes(odd_bytes[c]);
+    }
+  }
+#endif
+}
+
+correlation_predictor::correlation_predictor(int system_size,
+                                             int number_of_threads)
+    : system_size_(system_size), stride_(shadow::shot_stride(system_size)),
+      number_of_threads_(max(1, number_of_threads)),
+      number_of_shots_added_(0) {
+  if (system_size <= 0)
+    fail("システムサイズ %d は無効です。", system_size);
+  number_of_measurements_.assign((size_t)system_size * system_size * 9, 0);
+  sum_of_measurement_results_.assign((size_t)system_size * system_size * 9,
+                                     0);
+}
+
+double correlation_predictor::estimate(int i, int P, int j, int Q) const {
+  if (number_of_measurements(i, P, j, Q) == 0)
+    return 0;
+  return 1.0 * sum_of_measurement_results(i, P, j, Q) /
+         number_of_measurements(i, P, j, Q);
+}
+
+void correlation_predictor::add_shots(const shot_batch &shots) {
+  if (shots.stride() != stride_)
+    fail("システムサイズが一致しません。");
+  add_shots(shots.data(), shots.size());
+}
+
+//
+// 以下の関数はショットを correlation_block_shots 個ずつ転置して
+// accumulate_block に渡します。転置は 64 ショット x 64 量子ビットの
+// ビット行列ごとに行います。
+//
+void correlation_predictor::add_shots(const uint64_t *shots,
+                                      long long number_of_shots_to_scan) {
+  int number_of_qubit_words = stride_ / 3;
+  vector<uint64_t> bits;
+  for (long long first = 0; first < number_of_shots_to_scan;
+       first += correlation_block_shots) {
+    long long block_length = min((long long)correlation_block_shots,
+                                 number_of_shots_to_scan - first);
+    long long words_per_row = (block_length + 63) / 64;
+    bits.assign((size_t)system_size_ * 4 * words_per_row, 0);
+    parallel_for((int)words_per_row, number_of_threads_, [&](int w) {
+      int shots_in_word = (int)min(64LL, block_length - 64LL * w);
+      uint64_t valid = shots_in_word == 64 ? ~0ULL
+                                           : (1ULL << shots_in_word) - 1;
+      uint64_t basis_lo[64], basis_hi[64], outcome[64];
+      for (int g = 0; g < number_of_qubit_words; g++) {
+        for (int s = 0; s < 64; s++) {
+          if (s < shots_in_word) {
+            const uint64_t *word =
+                shots + (first + 64LL * w + s) * stride_ + 3 * g;
+            basis_lo[s] = word[0];
+            basis_hi[s] = word[1];
+            outcome[s] = word[2];
+          } else
+            basis_lo[s] = basis_hi[s] = outcome[s] = 0;
+        }
+        transpose_bit_matrix(basis_lo);
+        transpose_bit_matrix(basis_hi);
+        transpose_bit_matrix(outcome);
+        for (int k = 0; k < 64 && 64 * g + k < system_size_; k++) {
+          uint64_t *row = &bits[(size_t)(64 * g + k) * 4 * words_per_row + w];
+          row[0] = ~(basis_lo[k] | basis_hi[k]) & valid;
+          row[words_per_row] = basis_lo[k] & ~basis_hi[k];
+          row[2 * words_per_row] = basis_hi[k] & ~basis_lo[k];
+          row[3 * words_per_row] = outcome[k];
+        }
+      }
+    });
+    accumulate_block(bits, words_per_row);
+  }
+  number_of_shots_added_ += number_of_shots_to_scan;
+}
+
+void correlation_predictor::accumulate_block(const vector<uint64_t> &bits,
+                                             long long words_per_row) {
+  int number_of_tiles =
+      (system_size_ + correlation_tile_qubits - 1) / correlation_tile_qubits;
+  vector<pair<int, int>> tiles;
+  for (int ti = 0; ti < number_of_tiles; ti++)
+    for (int tj = ti; tj < number_of_tiles; tj++)
+      tiles.push_back(make_pair(ti, tj));
+
+  const int T = correlation_tile_qubits;
+  parallel_for((int)tiles.size(), number_of_threads_, [&](int t) {
+    int i_begin = tiles[t].first * T;
+    int i_end = min(system_size_, i_begin + T);
+    int j_begin = tiles[t].second * T;
+    int j_end = min(system_size_, j_begin + T);
+    // タイルの中の組 (i - i_begin, j - j_begin) の 9 通りの回数
+    vector<int> count(T * T * 9, 0), odd(T * T * 9, 0);
+
+    for (long long w_begin = 0; w_begin < words_per_row;
+         w_begin += correlation_tile_words) {
+      long long w_end = min(words_per_row, w_begin + correlation_tile_words);
+      for (int i = i_begin; i < i_end; i++) {
+        const uint64_t *row_i = &bits[(size_t)i * 4 * words_per_row];
+        for (int j = max(j_begin, i + 1); j < j_end; j++) {
+          const uint64_t *row_j = &bits[(size_t)j * 4 * words_per_row];
+          int *tile_count = &count[((i - i_begin) * T + j - j_begin) * 9];
+          int *tile_odd = &odd[((i - i_begin) * T + j - j_begin) * 9];
+          correlate_pair(row_i, row_j, words_per_row, w_begin, w_end,
+                         tile_count, tile_odd);
+        }
+      }
+    }
+
+    for (int i = i_begin; i < i_end; i++) {
+      for (int j = max(j_begin, i + 1); j < j_end; j++) {
+        for (int P = 0; P < 3; P++) {
+          for (int Q = 0; Q < 3; Q++) {
+            int c = ((i - i_begin) * T + j - j_begin) * 9 + 3 * P + Q;
+            int sum = count[c] - 2 * odd[c];
+            number_of_measurements_[index(i, P, j, Q)] += count[c];
+            sum_of_measurement_results_[index(i, P, j, Q)] += sum;
+            number_of_measurements_[index(j, Q, i, P)] += count[c];
+            sum_of_measurement_results_[index(j, Q, i, P)] += sum;
+          }
+        }
+      }
+    }
+
+    // 対角のタイルは 1 量子ビットの <P_i> も受け持つ
+    if (tiles[t].first != tiles[t].second)
+      return;
+    for (int i = i_begin; i < i_end; i++) {
+      const uint64_t *row_i = &bits[(size_t)i * 4 * words_per_row];
+      for (int P = 0; P < 3; P++) {
+        int single_count = 0, single_odd = 0;
+        for (long long w = 0; w < words_per_row; w++) {
+          uint64_t a = row_i[P * words_per_row + w];
+          single_count += (int)popcount_of_word(a);
+          single_odd += (int)popcount_of_word(a & row_i[3 * words_per_row + w]);
+        }
+        number_of_measurements_[index(i, P, i, P)] += single_count;
+        sum_of_measurement_results_[index(i, P, i, P)] +=
+            single_count - 2 * single_odd;
+      }
+    }
+  });
+}
+
+//
+// 以下の関数は予測値を CSV で output に書き出します。1 行目は見出しで、
+// 続く n * n 行は "i,j,XX,XY,XZ,YX,YY,YZ,ZX,ZY,ZZ" の順の予測値です。
+//
+void correlation_predictor::write_csv(FILE *output) const {
+  const char pauli_name[3] = {'X', 'Y', 'Z'};
+  string buffer = "i,j";
+  for (int P = 0; P < 3; P++)
+    for (int Q = 0; Q < 3; Q++)
+      buffer += string(",") + pauli_name[P] + pauli_name[Q];
+  buffer += '\n';
+  char value[64];
+  for (int i = 0; i < system_size_; i++) {
+    for (int j = 0; j < system_size_; j++) {
+      snprintf(value, sizeof(value), "%d,%d", i, j);
+      buffer += value;
+      for (int P = 0; P < 3; P++) {
+        for (int Q = 0; Q < 3; Q++) {
+          snprintf(value, sizeof(value), ",%f", estimate(i, P, j, Q));
+          buffer += value;
+        }
+      }
+      buffer += '\n';
+      if (buffer.size() >= (1 << 20)) {
+        fwrite(buffer.data(), 1, buffer.size(), output);
+        buffer.clear();
+      }
+    }
+  }
+  fwrite(buffer.data(), 1, buffer.size(), output);
+}
+
+//
+// バイナリ形式の相関ファイル:
+//   ヘッダ (32 バイト) の後に、予測値 (double) と測定回数 (int32_t) が
+//   それぞれ index(i, P, j, Q) の順に n * n * 9 個ずつ並びます。
+//
+const char binary_correlation_magic[8] = {'S', 'H', 'A', 'D',
+                                          'O', 'W', 'C', 1};
+struct binary_correlation_header {
+  char magic[8];
+  int32_t system_size;
+  int32_t number_of_paulis; // 9
+  int64_t number_of_shots;
+  int64_t reserved;
+};
+
+void correlation_predictor::write_binary(const string &binary_file_name) const {
+  FILE *binary_file = fopen(binary_file_name.c_str(), "wb");
+  if (binary_file == NULL)
+    fail("出力ファイル \"%s\" を作成できません。", binary_file_name.c_str());
+
+  binary_correlation_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, binary_correlation_magic, 8);
+  header.system_size = system_size_;
+  header.number_of_paulis = 9;
+  header.number_of_shots = number_of_shots_added_;
+
+  size_t number_of_values = number_of_measurements_.size();
+  vector<double> estimates(number_of_values);
+  for (size_t c = 0; c < number_of_values; c++)
+    estimates[c] = number_of_measurements_[c] == 0
+                       ? 0
+                       : 1.0 * sum_of_measurement_results_[c] /
+                             number_of_measurements_[c];
+  vector<int32_t> counts(number_of_measurements_.begin(),
+                         number_of_measurements_.end());
+  bool failed =
+      fwrite(&header, sizeof(header), 1, binary_file) != 1 ||
+      fwrite(estimates.data(), sizeof(double), number_of_values,
+             binary_file) != number_of_values ||
+      fwrite(counts.data(), sizeof(int32_t), number_of_values, binary_file) !=
+          number_of_values;
+  fclose(binary_file);
+  if (failed)
+    fail("\"%s\" への書き込みに失敗しました。", binary_file_name.c_str());
+}
+
+//
+// 以下の関数は accumulate_renyi と同じ加算を、部分系に制限した基底が
+// 同じショットをまとめて行います。
+//
+// 基底 beta が同じショットの組では、パウリ文字列の encoding は部分集合 b
+// だけで決まり、測定結果の積は (-1)^popcount(o & b) (o は -1 だった
+// 量子ビットのビット列) です。そこで組ごとに o のヒストグラムを作り、
+// アダマール変換 (Walsh-Hadamard transform) で 2^n 個の b の和を
+// O(n 2^n) で求めます。同じ測定設定を Nr 回繰り返したデータでは、
+// グレイコードの走査が組ごとに 1 回で済みます。
+// 加算される値はすべて整数なので、結果は accumulate_renyi と同一です。
+//
+void accumulate_renyi_grouped(const vector<int> &subsystem,
+                              const vector<uint64_t> &sorted_keys,
+                              double *sum_of_binary_outcome,
+                              double *number_of_outcomes) {
+  int subsystem_size = (int)subsystem.size();
+  long long number_of_subsets = 1LL << subsystem_size;
+  uint64_t outcome_mask = number_of_subsets - 1;
+  vector<long long> histogram(number_of_subsets);
+  vector<long long> encoding_of_subset(number_of_subsets);
+
+  for (size_t first = 0; first < sorted_keys.size();) {
+    uint64_t basis = sorted_keys[first] >> subsystem_size;
+    size_t last = first;
+    fill(histogram.begin(), histogram.end(), 0);
+    while (last < sorted_keys.size() &&
+           (sorted_keys[last] >> subsystem_size) == basis)
+      histogram[sorted_keys[last++] & outcome_mask]++;
+    long long group_size = (long long)(last - first);
+    first = last;
+
+    // sum[b] = sum_o histogram[o] (-1)^popcount(o & b)
+    for (long long half = 1; half < number_of_subsets; half <<= 1)
+      for (long long o = 0; o < number_of_subsets; o += 2 * half)
+        for (long long j = o; j < o + half; j++) {
+          long long even = histogram[j], odd = histogram[j + half];
+          histogram[j] = even + odd;
+          histogram[j + half] = even - odd;
+        }
+
+    encoding_of_subset[0] = 0;
+    sum_of_binary_outcome[0] += histogram[0];
+    number_of_outcomes[0] += group_size;
+    for (long long b = 1; b < number_of_subsets; b++) {
+      int i = __builtin_ctzll(b);
+      long long encoding = encoding_of_subset[b & (b - 1)] |
+                           (long long)(((basis >> (2 * i)) & 3) + 1) << (2 * i);
+      encoding_of_subset[b] = encoding;
+      sum_of_binary_outcome[encoding] += histogram[b];
+      number_of_outcomes[encoding] += group_size;
+    }
+  }
+}
+
+//
+// 以下の関数はショット列 shots (number_of_shots_to_scan 個) を走査し、
+// 部分系 subsystem 上のすべてのパウリ文字列 (2 ビット/量子ビットの encoding)
+// について、測定回数と測定結果の合計を加算します。
+//
+// 部分系に制限した基底の種類が少ない (繰り返し測定された) 場合は
+// accumulate_renyi_grouped で組ごとにまとめて加算します。
+//
+void accumulate_renyi(const vector<int> &subsystem, int stride,
+                      const uint64_t *shots, long long number_of_shots_to_scan,
+                      double *sum_of_binary_outcome,
+                      double *number_of_outcomes) {
+  int subsystem_size = (int)subsystem.size();
+
+  // 各ショットの (基底, 測定結果) を 1 つの鍵にしてソートし、基底の種類を
+  // 数える。組ごとのコスト (n + 1) 2^n がショットごとのコスト 2^n の
+  // 合計より小さければまとめて加算する。
+  if (subsystem_size >= 4 && number_of_shots_to_scan >= 2) {
+    vector<uint64_t> keys(number_of_shots_to_scan);
+    for (long long t = 0; t < number_of_shots_to_scan; t++) {
+      const uint64_t *shot = shots + t * stride;
+      uint64_t basis = 0, outcome = 0;
+      for (int i = 0; i < subsystem_size; i++) {
+        basis |= (uint64_t)shot_pauli(shot, subsystem[i]) << (2 * i);
+        outcome |= (uint64_t)(shot_outcome(shot, subsystem[i]) == -1) << i;
+      }
+      keys[t] = basis << subsystem_size | outcome;
+    }
+    sort(keys.begin(), keys.end());
+    long long number_of_groups = 1;
+    for (long long t = 1; t < number_of_shots_to_scan; t++)
+      number_of_groups +=
+          (keys[t] >> subsystem_size) != (keys[t - 1] >> subsystem_size);
+    if (number_of_groups * (subsystem_size + 1) < number_of_shots_to_scan) {
+      accumulate_renyi_grouped(subsystem, keys, sum_of_binary_outcome,
+                               number_of_outcomes);
+      return;
+    }
+  }
+
+  for (long long t = 0; t < number_of_shots_to_scan; t++) {
+    const uint64_t *shot = shots + t * stride;
+    long long encoding = 0, cumulative_outcome = 1;
+
+    sum_of_binary_outcome[0] += 1;
+    number_of_outcomes[0] += 1;
+
+    // グレイコード (Gray code) を使用して、すべての 2^n
+    // 個の可能な結果を反復処理
+    for (long long b = 1; b < (1 << subsystem_size); b++) {
+      long long change_i = __builtin_ctzll(b);
+      long long index_in_original_system = subsystem[change_i];
+
+      cumulative_outcome *= shot_outcome(shot, index_in_original_system);
+      encoding ^= (shot_pauli(shot, index_in_original_system) + 1LL)
+                  << (2LL * change_i);
+
+      sum_of_binary_outcome[encoding] += cumulative_outcome;
+      number_of_outcomes[encoding] += 1;
+    }
+  }
+}
+
+//
+// 以下の関数は予測された純度 tr(rho_A^2) を Renyi エントロピーに変換します。
+//
+double renyi_entropy_from_purity(double predicted_purity, int subsystem_size) {
+  return -1.0 * log2(min(max(predicted_purity, 1.0 / pow(2.0, subsystem_size)),
+                         1.0 - 1e-9));
+}
+
+//
+// 以下の関数は encoding c のパウリ文字列の恒等でない量子ビットの数を
+// 返します。
+//
+inline int number_of_non_identity(long long c) {
+  return __builtin_popcountll((c | (c >> 1)) & 0x5555555555555555ULL);
+}
+
+//
+// 以下の関数は accumulate_renyi で作られた表から
+// 部分系の Renyi エンタングルメントエントロピーを予測します。
+//
+double predict_renyi_entropy(int subsystem_size,
+                             const double *sum_of_binary_outcome,
+                             const double *number_of_outcomes) {
+  vector<int> level_cnt(2 * subsystem_size, 0);
+  vector<int> level_ttl(2 * subsystem_size, 0);
+
+  for (long long c = 0; c < (1 << (2 * subsystem_size)); c++) {
+    int nonId = number_of_non_identity(c);
+    if (number_of_outcomes[c] >= 2)
+      level_cnt[nonId]++;
+    level_ttl[nonId]++;
+  }
+
+  double predicted_entropy = 0;
+  for (long long c = 0; c < (1 << (2 * subsystem_size)); c++) {
+    if (number_of_outcomes[c] <= 1)
+      continue;
+
+    int nonId = number_of_non_identity(c);
+    predicted_entropy +=
+        ((double)1.0) / (number_of_outcomes[c] * (number_of_outcomes[c] - 1)) *
+        (sum_of_binary_outcome[c] * sum_of_binary_outcome[c] -
+         number_of_outcomes[c]) /
+        (1LL << subsystem_size) * level_ttl[nonId] / level_cnt[nonId];
+  }
+
+  return renyi_entropy_from_purity(predicted_entropy, subsystem_size);
+}
+
+//
+// ヒストグラムのエンジン:
+//   密な表はショットごとに 2^n 個の要素にランダムに加算します。この
+//   エンジンはまず、量子ビットごとの (基底, 測定結果) の 6 通りを 6 進数の
+//   桁にしたヒストグラム (6^n 個のビン) を作り、ショットごとには 1 回
+//   加算するだけにします。測定回数と測定結果の合計の表は、ヒストグラムに
+//   量子ビットの軸ごとに 6 -> 4 の変換
+//     I : 6 つのビンの和
+//     P : (P, +1) と (P, -1) のビンの和 (測定回数) または差 (測定結果)
+//   を施して求めます (アダマール変換の蝶演算と同じく軸ごとに分離できます)。
+//   軸 a の変換では処理済みの量子ビット 0, ..., a - 1 が下位の 4 進数の
+//   桁に並ぶので、最も内側のループは連続した 4^a 個の要素を走査します。
+//   すべての値は整数なので、表は accumulate_renyi の表と同一です。
+//
+inline long long number_of_histogram_bins(int subsystem_size) {
+  long long number_of_bins = 1;
+  for (int i = 0; i < subsystem_size; i++)
+    number_of_bins *= 6;
+  return number_of_bins;
+}
+
+//
+// 以下の関数はヒストグラム histogram に軸ごとの変換を施し、signed なら
+// 測定結果の合計の表を、そうでなければ測定回数の表を table に書き込みます。
+// buffer は 2 * 6^(n - 1) * 4 個の作業領域です。
+//
+void transform_renyi_histogram(int subsystem_size, const double *histogram,
+                               double *buffer, bool is_signed,
+                               double *table) {
+  if (subsystem_size == 0) {
+    table[0] = histogram[0];
+    return;
+  }
+  long long high = 1;
+  for (int i = 1; i < subsystem_size; i++)
+    high *= 6;
+  long long half = high * 4;
+  double sign = is_signed ? -1.0 : 1.0;
+
+  const double *source = histogram;
+  long long low = 1;
+  for (int a = 0; a < subsystem_size; a++) {
+    double *target = a + 1 == subsystem_size ? table
+                                             : buffer + (a % 2 == 0 ? 0 : half);
+    for (long long r = 0; r < high; r++) {
+      const double *in = source + r * 6 * low;
+      double *out = target + r * 4 * low;
+      for (long long l = 0; l < low; l++) {
+        double x_plus = in[l], x_minus = in[low + l];
+        double y_plus = in[2 * low + l], y_minus = in[3 * low + l];
+        double z_plus = in[4 * low + l], z_minus = in[5 * low + l];
+        out[l] = x_plus + x_minus + y_plus + y_minus + z_plus + z_minus;
+        out[low + l] = x_plus + sign * x_minus;
+        out[2 * low + l] = y_plus + sign * y_minus;
+        out[3 * low + l] = z_plus + sign * z_minus;
+      }
+    }
+    source = target;
+    high /= 6;
+    low *= 4;
+  }
+}
+
+double predict_renyi_entropy_histogram(const vector<int> &subsystem,
+                                       int stride, const uint64_t *shots,
+                                       long long number_of_shots_to_scan,
+                                       vector<double> &histogram,
+                                       vector<double> &buffer,
+                                       vector<double> &sum_of_binary_outcome,
+                                       vector<double> &number_of_outcomes) {
+  int subsystem_size = (int)subsystem.size();
+  long long number_of_bins = number_of_histogram_bins(subsystem_size);
+  size_t table_size = 1ULL << (2 * subsystem_size);
+  histogram.assign(number_of_bins, 0);
+  buffer.resize(2 * (number_of_bins / 6) * 4);
+  sum_of_binary_outcome.resize(table_size);
+  number_of_outcomes.resize(table_size);
+
+  for (long long t = 0; t < number_of_shots_to_scan; t++) {
+    const uint64_t *shot = shots + t * stride;
+    long long bin = 0;
+    for (int i = subsystem_size - 1; i >= 0; i--)
+      bin = bin * 6 + 2 * shot_pauli(shot, subsystem[i]) +
+            (shot_outcome(shot, subsystem[i]) == -1);
+    histogram[bin] += 1;
+  }
+
+  transform_renyi_histogram(subsystem_size, histogram.data(), buffer.data(),
+                            false, number_of_outcomes.data());
+  transform_renyi_histogram(subsystem_size, histogram.data(), buffer.data(),
+                            true, sum_of_binary_outcome.data());
+  return predict_renyi_entropy(subsystem_size, sum_of_binary_outcome.data(),
+                               number_of_outcomes.data());
+}
+
+//
+// 疎な (sparse) エンジン:
+//   密な表は 4^n 個の要素を持つため、部分系が大きくショット数が少ないと
+//   ほとんどの要素が空のままになります。このエンジンはグレイコードで
+//   パウリ文字列の台 (support) を 1 つずつ巡り、各ショットの encoding を
+//   その台に制限したもの (最大 T 個) をオープンアドレス法のハッシュ表で
+//   集計します。実際に現れた encoding だけを保持するので、使用メモリは
+//   O(T) です。level_cnt / level_ttl による正規化は台の大きさ (nonId) ごとに
+//   まとめて行います。
+//
+struct sparse_renyi_entry {
+  uint64_t encoding;
+  long long step; // このエントリを最後に使ったグレイコードのステップ
+  int number_of_outcomes;
+  int sum_of_binary_outcome;
+};
+
+double predict_renyi_entropy_sparse(const vector<int> &subsystem, int stride,
+                                    const uint64_t *shots,
+                                    long long number_of_shots_to_scan,
+                                    vector<uint64_t> &encodings,
+                                    vector<int> &cumulative_outcomes,
+                                    vector<sparse_renyi_entry> &hash_table,
+                                    vector<int> &used_slots) {
+  int subsystem_size = (int)subsystem.size();
+  long long T = number_of_shots_to_scan;
+
+  int hash_bits = 1;
+  while ((1LL << hash_bits) < 2 * T)
+    hash_bits++;
+  encodings.assign(T, 0);
+  cumulative_outcomes.assign(T, 1);
+  sparse_renyi_entry empty_entry = {0, -1, 0, 0};
+  hash_table.assign(1LL << hash_bits, empty_entry);
+  used_slots.resize(T);
+
+  // 台の大きさ (nonId) ごとの寄与の合計と、2 回以上測定された
+  // パウリ文字列の数
+  vector<double> level_sum(subsystem_size + 1, 0);
+  vector<double> level_cnt(subsystem_size + 1, 0);
+  if (T >= 2) {
+    level_sum[0] = 1; // 恒等演算子: (T^2 - T) / (T (T - 1))
+    level_cnt[0] = 1;
+  }
+
+  for (long long b = 1; b < (1LL << subsystem_size); b++) {
+    long long change_i = __builtin_ctzll(b);
+    long long index_in_original_system = subsystem[change_i];
+    int nonId = __builtin_popcountll(b ^ (b >> 1)); // 現在の台の大きさ
+
+    int number_of_used_slots = 0;
+    for (long long t = 0; t < T; t++) {
+      const uint64_t *shot = shots + t * stride;
+      cumulative_outcomes[t] *= shot_outcome(shot, index_in_original_system);
+      encodings[t] ^= (shot_pauli(shot, index_in_original_system) + 1ULL)
+                      << (2LL * change_i);
+
+      uint64_t slot =
+          (encodings[t] * 0x9E3779B97F4A7C15ULL) >> (64 - hash_bits);
+      while (hash_table[slot].step == b &&
+             hash_table[slot].encoding != encodings[t])
+        slot = (slot + 1) & ((1ULL << hash_bits) - 1);
+
+      sparse_renyi_entry &entry = hash_table[slot];
+      if (entry.step != b) {
+        entry.encoding = encodings[t];
+        entry.step = b;
+        entry.number_of_outcomes = 0;
+        entry.sum_of_binary_outcome = 0;
+        used_slots[number_of_used_slots++] = (int)slot;
+      }
+      entry.number_of_outcomes++;
+      entry.sum_of_binary_outcome += cumulative_outcomes[t];
+    }
+
+    for (int u = 0; u < number_of_used_slots; u++) {
+      const sparse_renyi_entry &entry = hash_table[used_slots[u]];
+      double number = entry.number_of_outcomes;
+      double sum = entry.sum_of_binary_outcome;
+      if (number <= 1)
+        continue;
+      level_sum[nonId] += ((double)1.0) / (number * (number - 1)) *
+                          (sum * sum - number);
+      level_cnt[nonId]++;
+    }
+  }
+
+  double predicted_entropy = 0;
+  double level_ttl = 1; // C(n, nonId) * 3^nonId
+  for (int nonId = 0; nonId <= subsystem_size; nonId++) {
+    if (level_cnt[nonId] > 0)
+      predicted_entropy += level_sum[nonId] / (1LL << subsystem_size) *
+                           level_ttl / level_cnt[nonId];
+    level_ttl = level_ttl * 3 * (subsystem_size - nonId) / (nonId + 1);
+  }
+
+  return renyi_entropy_from_purity(predicted_entropy, subsystem_size);
+}
+
+//
+// ペア (kernel) エンジン:
+//   グレイコードを使うエンジンはショットごとに 2^n 個のパウリ文字列を
+//   数えるため、部分系の大きさに対して指数的にコストが増えます。
+//   このエンジンは異なるショットのペア (t, t') について
+//     tr(rho_t rho_t') = prod_q k(t, t', q)
+//   の平均として純度を推定します。量子ビット q ごとの因子 k は
+//     基底が同じで結果も同じ: 5, 基底が同じで結果が異なる: -4,
+//     基底が異なる: 1/2
+//   です (rho_t = tensor_q (3 |s_q><s_q| - I) は各ショットの古典シャドウ)。
+//   基底と結果をビットパックしておくと、基底・結果が一致する量子ビットの数
+//   (a, b) は AND/XOR/popcount で求まり、ペアの値は (a, b) だけで決まります。
+//   そこで (a, b) ごとのペアの数を整数で数えてから最後に重み付けするので、
+//   コストは O(T^2 n / 64) で、加算の丸め誤差もありません。
+//   この推定量は各量子ビットの基底が一様ランダムに選ばれていることを
+//   仮定しています。
+//
+const int kernel_tile_size = 64;
+
+double predict_renyi_entropy_kernel(const vector<int> &subsystem, int stride,
+                                    const uint64_t *shots,
+                                    long long number_of_shots_to_scan,
+                                    vector<uint64_t> &packed_subsystem,
+                                    vector<long long> &pair_histogram) {
+  int subsystem_size = (int)subsystem.size();
+  long long T = number_of_shots_to_scan;
+  int W = (subsystem_size + 63) / 64; // 部分系を表すワード数
+
+  // 部分系に制限したショットを (basis_lo, basis_hi, outcome) の
+  // ワードごとに連続した配列に詰め直す
+  packed_subsystem.assign((size_t)3 * W * T, 0);
+  for (long long t = 0; t < T; t++) {
+    const uint64_t *shot = shots + t * stride;
+    for (int i = 0; i < subsystem_size; i++) {
+      int pauli = shot_pauli(shot, subsystem[i]);
+      uint64_t bit = 1ULL << (i & 63);
+      uint64_t *word = &packed_subsystem[(size_t)3 * (i >> 6) * T + t];
+      if (pauli & 1)
+        word[0] |= bit;
+      if (pauli & 2)
+        word[T] |= bit;
+      if (shot_outcome(shot, subsystem[i]) == -1)
+        word[2 * T] |= bit;
+    }
+  }
+  vector<uint64_t> valid_bits(W, ~0ULL);
+  if (subsystem_size % 64 != 0)
+    valid_bits[W - 1] = (1ULL << (subsystem_size % 64)) - 1;
+
+  // a = 基底も結果も一致する量子ビットの数, b = 基底だけ一致する量子ビットの数
+  // として pair_histogram[a * (n + 1) + b] にペアの数を数える
+  int histogram_stride = subsystem_size + 1;
+  pair_histogram.assign((size_t)histogram_stride * histogram_stride, 0);
+  int same_outcome[kernel_tile_size], different_outcome[kernel_tile_size];
+  for (long long tile1 = 0; tile1 < T; tile1 += kernel_tile_size) {
+    long long tile1_end = min(T, tile1 + kernel_tile_size);
+    for (long long tile2 = tile1; tile2 < T; tile2 += kernel_tile_size) {
+      long long tile2_end = min(T, tile2 + kernel_tile_size);
+      for (long long t = tile1; t < tile1_end; t++) {
+        long long first_u = max(tile2, t + 1);
+        int length = (int)(tile2_end - first_u);
+        if (length <= 0)
+          continue;
+        for (int u = 0; u < length; u++)
+          same_outcome[u] = different_outcome[u] = 0;
+        for (int w = 0; w < W; w++) {
+          const uint64_t *basis_lo = &packed_subsystem[(size_t)3 * w * T];
+          const uint64_t *basis_hi = basis_lo + T;
+          const uint64_t *outcome = basis_hi + T;
+          uint64_t lo = basis_lo[t], hi = basis_hi[t], out = outcome[t];
+          for (int u = 0; u < length; u++) {
+            uint64_t same_basis = ~((basis_lo[first_u + u] ^ lo) |
+                                    (basis_hi[first_u + u] ^ hi)) &
+                                  valid_bits[w];
+            uint64_t flipped = outcome[first_u + u] ^ out;
+            same_outcome[u] += (int)popcount_of_word(same_basis & ~flipped);
+            different_outcome[u] += (int)popcount_of_word(same_basis & flipped);
+          }
+        }
+        for (int u = 0; u < length; u++)
+          pair_histogram[same_outcome[u] * histogram_stride +
+                         different_outcome[u]]++;
+      }
+    }
+  }
+
+  double predicted_purity = 0;
+  if (T >= 2) {
+    for (int a = 0; a <= subsystem_size; a++)
+      for (int b = 0; a + b <= subsystem_size; b++)
+        if (pair_histogram[a * histogram_stride + b] != 0)
+          predicted_purity += pair_histogram[a * histogram_stride + b] *
+                              pow(5.0, a) * pow(-4.0, b) *
+                              pow(0.5, subsystem_size - a - b);
+    predicted_purity *= 2.0 / ((double)T * (T - 1));
+  }
+
+  return renyi_entropy_from_purity(predicted_purity, subsystem_size);
+}
+
+//
+// 閉包 (closure) エンジン:
+//   パウリ文字列 P の測定回数と測定結果の合計は、P の台 U (恒等でない
+//   量子ビットの集合) の上の各ショットの基底と結果だけで決まり、P を含む
+//   部分系にはよりません。そこで部分系のすべての部分集合 (閉包) を量子
+//   ビットの昇順の列として 1 つのトライにまとめ、台がちょうど U である
+//   3^|U| 個のパウリ文字列の表を U のノードに持たせます。入れ子の鎖
+//   {0}, {0, 1}, ... や大きさ k 以下のすべての部分集合のように台を共有する
+//   部分系の族では、共有された台は一度だけ数えられ、すべての部分系の表が
+//   1 回のショットの走査で作られます (A ∪ {q} の表は A の表に q を含む台を
+//   加えたものです)。
+//   各部分系のエントロピーはトライの表から predict_renyi_entropy と同じ
+//   順番で同じ式を足し合わせて求めるので、結果は密なエンジンと同一です。
+//
+struct closure_trie_node {
+  int qubit;
+  int depth;
+  int parent;
+  long long table_offset; // 台がこのノードのパウリ文字列の表 (3^depth 個)
+};
+
+struct closure_table_entry {
+  int number_of_outcomes;
+  int sum_of_binary_outcome;
+};
+
+// 1 回の走査で保持する表の要素数の目安 (最大の密な表と同じ)。これを
+// 超えると、それまでの部分系をまとめて処理してからトライを作り直す。
+const long long max_closure_table_entries = 1LL
+                                            << (2 * max_dense_subsystem_size);
+
+class closure_trie {
+public:
+  closure_trie() { clear(); }
+
+  void clear() {
+    closure_trie_node root = {-1, 0, -1, 0};
+    nodes_.assign(1, root);
+    children_.clear();
+    table_entries_ = 1;
+  }
+  int size() const { return (int)nodes_.size(); }
+  long long table_entries() const { return table_entries_; }
+
+  //
+  // 以下の関数は量子ビットが昇順で重複のない部分系 qubits の
+  // すべての部分集合をトライに加えます。
+  //
+  void insert_subsets(const vector<int> &qubits, int first = 0, int node = 0) {
+    for (int i = first; i < (int)qubits.size(); i++) {
+      pair<int, int> key = make_pair(node, qubits[i]);
+      map<pair<int, int>, int>::iterator child = children_.find(key);
+      int next_node;
+      if (child != children_.end())
+        next_node = child->second;
+      else {
+        next_node = (int)nodes_.size();
+        closure_trie_node trie_node = {qubits[i], nodes_[node].depth + 1, node,
+                                       0};
+        nodes_.push_back(trie_node);
+        children_[key] = next_node;
+        table_entries_ += power_of_three(trie_node.depth);
+      }
+      insert_subsets(qubits, i + 1, next_node);
+    }
+  }
+
+  //
+  // 以下の関数はノードを前順に並べ直し、表を確保します。
+  //
+  void finish() {
+    vector<int> position(nodes_.size());
+    vector<closure_trie_node> preorder;
+    vector<int> stack(1, 0);
+    while (!stack.empty()) {
+      int node = stack.back();
+      stack.pop_back();
+      position[node] = (int)preorder.size();
+      preorder.push_back(nodes_[node]);
+      map<pair<int, int>, int>::iterator child =
+          children_.upper_bound(make_pair(node, INT_MAX));
+      while (child != children_.begin() && (--child)->first.first == node)
+        stack.push_back(child->second);
+    }
+    map<pair<int, int>, int> children;
+    for (map<pair<int, int>, int>::iterator child = children_.begin();
+         child != children_.end(); child++)
+      children[make_pair(position[child->first.first], child->first.second)] =
+          position[child->second];
+    children_.swap(children);
+
+    long long table_offset = 0;
+    for (closure_trie_node &trie_node : preorder) {
+      if (trie_node.parent >= 0)
+        trie_node.parent = position[trie_node.parent];
+      trie_node.table_offset = table_offset;
+      table_offset += power_of_three(trie_node.depth);
+    }
+    nodes_.swap(preorder);
+    closure_table_entry empty_entry = {0, 0};
+    tables_.assign(table_offset, empty_entry);
+  }
+
+  //
+  // 以下の関数はショット列 shots (number_of_shots_to_scan 個) を走査し、
+  // すべてのノードの表に測定回数と測定結果の合計を加算します。
+  // ノードの区間 (チャンク) ごとに number_of_threads 個のスレッドで並列に
+  // 処理され、チャンクは自分のノードの表だけに書き込みます。
+  //
+  // トライの量子ビットに制限した基底が同じショットが平均 8 個以上ある
+  // (繰り返し測定された) 場合は、ショットを基底ごとの組にまとめます。
+  // 組の中では表の位置はノードごとに 1 つに決まり、測定結果の積は
+  // 量子ビットごとの測定結果のビット列 (組のショットごとに 1 ビット) の
+  // XOR と popcount でまとめて求まります。
+  //
+  void accumulate(int stride, const uint64_t *shots,
+                  long long number_of_shots_to_scan, int number_of_threads) {
+    int number_of_nodes = size();
+    long long T = number_of_shots_to_scan;
+    // チャンクの先頭でショット (組) ごとに祖先をたどり直すので、
+    // 小さすぎるチャンクは作らない
+    int target_nodes = max(
+        16, (number_of_nodes + 4 * number_of_threads - 1) /
+                (4 * number_of_threads));
+    vector<int> chunk_begin(1, 1);
+    long long chunk_entries = 0;
+    for (int node = 1; node < number_of_nodes; node++) {
+      chunk_entries += power_of_three(nodes_[node].depth);
+      int chunk_nodes = node + 1 - chunk_begin.back();
+      if (chunk_nodes >= target_nodes ||
+          (chunk_nodes >= 16 && chunk_entries >= (1 << 16))) {
+        chunk_begin.push_back(node + 1);
+        chunk_entries = 0;
+      }
+    }
+    if (chunk_begin.back() != number_of_nodes)
+      chunk_begin.push_back(number_of_nodes);
+    int number_of_chunks = (int)chunk_begin.size() - 1;
+
+    int max_depth = 0;
+    for (const closure_trie_node &trie_node : nodes_)
+      max_depth = max(max_depth, trie_node.depth);
+    vector<int> powers(max_depth + 1, 1);
+    for (int d = 1; d <= max_depth; d++)
+      powers[d] = 3 * powers[d - 1];
+
+    // チャンクの最初のノードの祖先 (根を除く、浅い順)
+    vector<vector<int>> ancestors(number_of_chunks);
+    for (int c = 0; c < number_of_chunks; c++) {
+      for (int node = nodes_[chunk_begin[c]].parent; node > 0;
+           node = nodes_[node].parent)
+        ancestors[c].push_back(node);
+      reverse(ancestors[c].begin(), ancestors[c].end());
+    }
+
+    // トライの量子ビット (列) に制限した基底でショットを並べ替え、組を作る
+    vector<int> qubit_of_column;
+    for (int node = 1; node < number_of_nodes; node++)
+      qubit_of_column.push_back(nodes_[node].qubit);
+    sort(qubit_of_column.begin(), qubit_of_column.end());
+    qubit_of_column.erase(
+        unique(qubit_of_column.begin(), qubit_of_column.end()),
+        qubit_of_column.end());
+    int number_of_columns = (int)qubit_of_column.size();
+    vector<int> column_of_node(number_of_nodes, 0);
+    for (int node = 1; node < number_of_nodes; node++)
+      column_of_node[node] =
+          (int)(lower_bound(qubit_of_column.begin(), qubit_of_column.end(),
+                            nodes_[node].qubit) -
+                qubit_of_column.begin());
+    int number_of_words = stride / 3;
+    vector<uint64_t> basis_mask(number_of_words, 0);
+    for (int qubit : qubit_of_column)
+      basis_mask[qubit >> 6] |= 1ULL << (qubit & 63);
+    auto basis_less = [&](long long a, long long b) {
+      const uint64_t *shot_a = shots + a * stride, *shot_b = shots + b * stride;
+      for (int w = 0; w < number_of_words; w++)
+        for (int h = 0; h < 2; h++) {
+          uint64_t x = shot_a[3 * w + h] & basis_mask[w];
+          uint64_t y = shot_b[3 * w + h] & basis_mask[w];
+          if (x != y)
+            return x < y;
+        }
+      return false;
+    };
+    vector<long long> order(T);
+    for (long long t = 0; t < T; t++)
+      order[t] = t;
+    sort(order.begin(), order.end(), basis_less);
+    vector<long long> group_begin;
+    for (long long t = 0; t < T; t++)
+      if (t == 0 || basis_less(order[t - 1], order[t]))
+        group_begin.push_back(t);
+    long long number_of_groups = (long long)group_begin.size();
+    group_begin.push_back(T);
+
+    if (number_of_groups * 8 > T ||
+        number_of_columns * (number_of_groups + T / 64) > (1LL << 26)) {
+      // ショットごとに走査する
+      parallel_for(number_of_chunks, number_of_threads, [&](int c) {
+        // 深さ d のノードの表の中の位置と、-1 の測定結果の数の偶奇
+        vector<int> code(max_depth + 1, 0), parity(max_depth + 1, 0);
+        for (long long t = 0; t < T; t++) {
+          const uint64_t *shot = shots + t * stride;
+          for (int node : ancestors[c]) {
+            int d = nodes_[node].depth, qubit = nodes_[node].qubit;
+            code[d] = code[d - 1] + shot_pauli(shot, qubit) * powers[d - 1];
+            parity[d] = parity[d - 1] ^ (shot_outcome(shot, qubit) == -1);
+          }
+          for (int node = chunk_begin[c]; node < chunk_begin[c + 1]; node++) {
+            const closure_trie_node &trie_node = nodes_[node];
+            int d = trie_node.depth, qubit = trie_node.qubit;
+            code[d] = code[d - 1] + shot_pauli(shot, qubit) * powers[d - 1];
+            parity[d] = parity[d - 1] ^ (shot_outcome(shot, qubit) == -1);
+            closure_table_entry &entry =
+                tables_[trie_node.table_offset + code[d]];
+            entry.number_of_outcomes++;
+            entry.sum_of_binary_outcome += 1 - 2 * parity[d];
+          }
+        }
+      });
+    } else {
+      // 組 g の列 (量子ビット) ごとの測定結果のビット列は
+      // outcome_bits[group_offset[g] * 列の数 + 列 * 組のワード数] から
+      vector<long long> group_offset(number_of_groups + 1, 0);
+      int max_group_words = 1;
+      for (long long g = 0; g < number_of_groups; g++) {
+        int group_words =
+            (int)((group_begin[g + 1] - group_begin[g] + 63) / 64);
+        group_offset[g + 1] = group_offset[g] + group_words;
+        max_group_words = max(max_group_words, group_words);
+      }
+      vector<uint64_t> outcome_bits(
+          (size_t)group_offset[number_of_groups] * number_of_columns, 0);
+      for (long long g = 0; g < number_of_groups; g++) {
+        int group_words = (int)(group_offset[g + 1] - group_offset[g]);
+        uint64_t *bits = &outcome_bits[group_offset[g] * number_of_columns];
+        for (long long t = group_begin[g]; t < group_begin[g + 1]; t++) {
+          const uint64_t *shot = shots + order[t] * stride;
+          long long j = t - group_begin[g];
+          for (int column = 0; column < number_of_columns; column++)
+            if (shot_outcome(shot, qubit_of_column[column]) == -1)
+              bits[column * group_words + (j >> 6)] |= 1ULL << (j & 63);
+        }
+      }
+
+      parallel_for(number_of_chunks, number_of_threads, [&](int c) {
+        vector<int> code(max_depth + 1, 0);
+        vector<uint64_t> parity((size_t)(max_depth + 1) * max_group_words, 0);
+        for (long long g = 0; g < number_of_groups; g++) {
+          const uint64_t *shot = shots + order[group_begin[g]] * stride;
+          int group_size = (int)(group_begin[g + 1] - group_begin[g]);
+          int group_words = (int)(group_offset[g + 1] - group_offset[g]);
+          const uint64_t *bits =
+              &outcome_bits[group_offset[g] * number_of_columns];
+          // 深さ d のビット列を求めて、-1 の測定結果の数を返す
+          auto update = [&](int node, int d) {
+            code[d] = code[d - 1] +
+                      shot_pauli(shot, nodes_[node].qubit) * powers[d - 1];
+            const uint64_t *column_bits =
+                bits + column_of_node[node] * group_words;
+            uint64_t *previous = &parity[(size_t)(d - 1) * max_group_words];
+            uint64_t *current = previous + max_group_words;
+            int number_of_odd = 0;
+            for (int w = 0; w < group_words; w++) {
+              current[w] = previous[w] ^ column_bits[w];
+              number_of_odd += (int)popcount_of_word(current[w]);
+            }
+            return number_of_odd;
+          };
+          for (int node : ancestors[c])
+            update(node, nodes_[node].depth);
+          for (int node = chunk_begin[c]; node < chunk_begin[c + 1]; node++) {
+            const closure_trie_node &trie_node = nodes_[node];
+            int number_of_odd = update(node, trie_node.depth);
+            closure_table_entry &entry =
+                tables_[trie_node.table_offset + code[trie_node.depth]];
+            entry.number_of_outcomes += group_size;
+            entry.sum_of_binary_outcome += group_size - 2 * number_of_odd;
+          }
+        }
+      });
+    }
+    tables_[0].number_of_outcomes += (int)T;
+    tables_[0].sum_of_binary_outcome += (int)T;
+  }
+
+  //
+  // 以下の関数は部分系 subsystem (量子ビットに重複なし) のエントロピーを
+  // 予測します。密な表を作らずに、predict_renyi_entropy と同じ順番
+  // (accumulate_renyi の encoding c の順) で同じ式を足し合わせます。
+  // encoding c の台 b (恒等でない位置の集合) のノードは、b から量子ビットの
+  // 最も大きい位置を除いた集合のノードの子です。
+  //
+  double predict_entropy(const vector<int> &subsystem) const {
+    int subsystem_size = (int)subsystem.size();
+    long long number_of_subsets = 1LL << subsystem_size;
+    vector<int> node_of_subset(number_of_subsets, 0);
+    for (long long b = 1; b < number_of_subsets; b++) {
+      int largest = -1;
+      for (int i = 0; i < subsystem_size; i++)
+        if (((b >> i) & 1) &&
+            (largest < 0 || subsystem[i] > subsystem[largest]))
+          largest = i;
+      node_of_subset[b] = children_.at(make_pair(
+          node_of_subset[b ^ (1LL << largest)], subsystem[largest]));
+    }
+
+    vector<int> level_cnt(2 * subsystem_size + 1, 0);
+    vector<int> level_ttl(2 * subsystem_size + 1, 0);
+    for (long long b = 0; b < number_of_subsets; b++) {
+      const closure_trie_node &trie_node = nodes_[node_of_subset[b]];
+      long long table_size = power_of_three(trie_node.depth);
+      for (long long code = 0; code < table_size; code++)
+        if (tables_[trie_node.table_offset + code].number_of_outcomes >= 2)
+          level_cnt[trie_node.depth]++;
+      level_ttl[trie_node.depth] += (int)table_size;
+    }
+
+    // 表の位置 code は台の中の量子ビットの順位 r のパウリ p の
+    // sum p 3^r です。量子ビットが昇順なら位置 i 以上の部分 partial[i] を
+    // c の各桁が変わるたびに更新し、そうでなければ c ごとに計算します。
+    bool is_sorted = true;
+    for (int i = 1; i < subsystem_size; i++)
+      is_sorted = is_sorted && subsystem[i - 1] < subsystem[i];
+    vector<long long> smaller(subsystem_size, 0), powers(subsystem_size, 1);
+    for (int i = 0; i < subsystem_size; i++) {
+      for (int j = 0; j < subsystem_size; j++)
+        if (subsystem[j] < subsystem[i])
+          smaller[i] |= 1LL << j;
+      if (i > 0)
+        powers[i] = 3 * powers[i - 1];
+    }
+    vector<int> digits(subsystem_size, 0);
+    vector<long long> partial(subsystem_size + 1, 0);
+    long long b = 0;
+    double predicted_entropy = 0;
+    for (;;) {
+      long long code = partial[0];
+      if (!is_sorted) {
+        code = 0;
+        for (int i = 0; i < subsystem_size; i++)
+          if (digits[i] != 0)
+            code += (digits[i] - 1) *
+                    powers[__builtin_popcountll(b & smaller[i])];
+      }
+      const closure_trie_node &trie_node = nodes_[node_of_subset[b]];
+      const closure_table_entry &entry =
+          tables_[trie_node.table_offset + code];
+      double number_of_outcomes = entry.number_of_outcomes;
+      double sum_of_binary_outcome = entry.sum_of_binary_outcome;
+      if (number_of_outcomes > 1) {
+        int nonId = trie_node.depth;
+        predicted_entropy +=
+            ((double)1.0) / (number_of_outcomes * (number_of_outcomes - 1)) *
+            (sum_of_binary_outcome * sum_of_binary_outcome -
+             number_of_outcomes) /
+            (1LL << subsystem_size) * level_ttl[nonId] / level_cnt[nonId];
+      }
+
+      int i = 0;
+      while (i < subsystem_size && digits[i] == 3) {
+        digits[i] = 0;
+        b &= ~(1LL << i++);
+      }
+      if (i == subsystem_size)
+        break;
+      digits[i]++;
+      b |= 1LL << i;
+      partial[i] = partial[i + 1] * 3 + digits[i] - 1;
+      for (int j = i - 1; j >= 0; j--)
+        partial[j] = partial[i];
+    }
+
+    return renyi_entropy_from_purity(predicted_entropy, subsystem_size);
+  }
+
+private:
+  static long long power_of_three(int exponent) {
+    long long power = 1;
+    while (exponent-- > 0)
+      power *= 3;
+    return power;
+  }
+
+  vector<closure_trie_node> nodes_;
+  map<pair<int, int>, int> children_; // (親, 量子ビット) -> 子
+  long long table_entries_;
+  vector<closure_table_entry> tables_;
+};
+
+//
+// 以下の関数は経過時間 (wall) とプロセスの CPU 時間 (すべてのスレッドの
+// 合計) を秒で返します。
+//
+double wall_clock_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+double cpu_clock_seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+//
+// Renyi エンタングルメントエントロピーの予測
+//
+renyi_predictor::renyi_predictor(const string &engine, int number_of_threads)
+    : engine_(engine), number_of_threads_(max(1, number_of_threads)) {
+  if (engine_ != "dense" && engine_ != "sparse" && engine_ != "kernel" &&
+      engine_ != "closure" && engine_ != "histogram" && engine_ != "auto")
+    fail("不明なエンジン \"%s\" です。", engine_.c_str());
+}
+
+//
+// 以下の関数はヒストグラムのエンジンのショットあたりのコスト (ビンの変換の
+// コストをショットに割り振ったものを含む) を返します。
+//
+inline long long histogram_cost_per_shot(int subsystem_size,
+                                         long long number_of_shots) {
+  return subsystem_size +
+         10 * number_of_histogram_bins(subsystem_size) /
+             max(1LL, number_of_shots);
+}
+
+//
+// エンジンの選択 (--engine dense|sparse|kernel|closure|histogram|auto):
+//   グレイコードを使うエンジンのコストは T 2^n、ペアのエンジンのコストは
+//   T^2 / 2 に比例します。auto では 2^n <= T / 2 ならグレイコードを使い、
+//   部分系が max_dense_subsystem_size 以下なら密な表を、それより大きければ
+//   疎な集計を選びます。それ以外ではペアのエンジンを選びます (基底が
+//   一様ランダムであることを仮定するので、prediction_shadow は auto が
+//   ペアのエンジンを選んだ部分系を標準エラー出力に示します)。
+//   ただし、ヒストグラムの変換のコスト (ビンあたり密な表の加算の約 10 回分)
+//   がグレイコードのコストより小さければヒストグラムのエンジンを選びます。
+//   密な表かヒストグラムを選んだ部分系は、predict でまとめて閉包の
+//   エンジンに回されることがあります (結果は同一です)。
+//
+string renyi_predictor::engine_for(int subsystem_size,
+                                   long long number_of_shots) const {
+  if (engine_ != "auto")
+    return engine_;
+  if (subsystem_size <= max_histogram_subsystem_size &&
+      10 * number_of_histogram_bins(subsystem_size) <
+          (number_of_shots << subsystem_size))
+    return "histogram";
+  if (subsystem_size < 62 && 2 * (1LL << subsystem_size) <= number_of_shots)
+    return subsystem_size <= max_dense_subsystem_size ? "dense" : "sparse";
+  return "kernel";
+}
+
+//
+// 以下の関数はすべての部分系のエントロピーを予測します。
+// 部分系は number_of_threads 個のスレッドに動的に割り当てられ、並列に
+// 処理されます。各スレッドは自分専用の作業領域を持ち、必要に応じて
+// 拡張しながら再利用します。
+//
+// 閉包のエンジンでは、部分系をファイルの順に 1 つのトライにまとめ、表の
+// 要素数が max_closure_table_entries を超えるごとにそれまでの部分系を
+// 1 回の走査で処理します。auto では密な表かヒストグラムを選んだ部分系を
+// まとめ、トライのノード数 (ショットごとのコスト) が部分系ごとに処理する
+// コストの合計より小さくなる場合だけ閉包のエンジンを使います。
+//
+vector<double>
+renyi_predictor::predict(const vector<vector<int>> &subsystems,
+                         const shot_batch &shots,
+                         vector<renyi_subsystem_profile> *profile) const {
+  int number_of_subsystems = (int)subsystems.size();
+  vector<double> predicted_entropies(number_of_subsystems);
+  if (profile != NULL)
+    profile->assign(number_of_subsystems, renyi_subsystem_profile());
+  long long number_of_shots = shots.size();
+
+  for (int s = 0; s < number_of_subsystems; s++) {
+    int subsystem_size = (int)subsystems[s].size();
+    string engine = engine_for(subsystem_size, number_of_shots);
+    if (((engine == "dense" || engine == "closure") &&
+         subsystem_size > max_dense_subsystem_size) ||
+        (engine == "sparse" && subsystem_size > max_sparse_subsystem_size) ||
+        (engine == "histogram" &&
+         subsystem_size > max_histogram_subsystem_size))
+      fail("%d 番目の部分系 (サイズ %d) は大きすぎます。", s + 1,
+           subsystem_size);
+    for (int i = 0; i < subsystem_size; i++)
+      if (subsystems[s][i] < 0 || subsystems[s][i] >= shots.system_size())
+        fail("%d 番目の部分系の量子ビット %d がシステムの範囲外です。", s + 1,
+             subsystems[s][i]);
+  }
+
+  // 閉包のエンジン (表の要素は int なので T <= INT_MAX の場合だけ)
+  vector<char> is_predicted(number_of_subsystems, 0);
+  closure_trie trie;
+  vector<int> batch;
+  long long separate_cost = 0;
+  auto predict_batch = [&]() {
+    double start = wall_clock_seconds();
+    trie.finish();
+    trie.accumulate(shots.stride(), shots.data(), number_of_shots,
+                    number_of_threads_);
+    double seconds_per_subsystem =
+        (wall_clock_seconds() - start) / batch.size();
+
+    atomic<int> next_task(0);
+    auto worker = [&]() {
+      for (int task = next_task++; task < (int)batch.size();
+           task = next_task++) {
+        int s = batch[task];
+        double start = profile != NULL ? wall_clock_seconds() : 0.0;
+        predicted_entropies[s] = trie.predict_entropy(subsystems[s]);
+        is_predicted[s] = 1;
+        if (profile != NULL)
+          (*profile)[s] = {"closure", 1LL << (2 * subsystems[s].size()),
+                           seconds_per_subsystem + wall_clock_seconds() -
+                               start};
+      }
+    };
+    vector<thread> workers;
+    for (int i = 1; i < min(number_of_threads_, (int)batch.size()); i++)
+      workers.push_back(thread(worker));
+    worker();
+    for (int i = 0; i < (int)workers.size(); i++)
+      workers[i].join();
+  };
+  for (int s = 0; s < number_of_subsystems && number_of_shots <= INT_MAX;
+       s++) {
+    string engine = engine_for((int)subsystems[s].size(), number_of_shots);
+    vector<int> sorted_qubits = subsystems[s];
+    sort(sorted_qubits.begin(), sorted_qubits.end());
+    if ((engine == "closure" ||
+         (engine_ == "auto" && (engine == "dense" || engine == "histogram"))) &&
+        adjacent_find(sorted_qubits.begin(), sorted_qubits.end()) ==
+            sorted_qubits.end()) {
+      trie.insert_subsets(sorted_qubits);
+      batch.push_back(s);
+      separate_cost +=
+          engine == "histogram"
+              ? histogram_cost_per_shot((int)sorted_qubits.size(),
+                                        number_of_shots)
+              : 1LL << sorted_qubits.size();
+    }
+    if (batch.empty() ||
+        (trie.table_entries() < max_closure_table_entries &&
+         s + 1 < number_of_subsystems))
+      continue;
+    if (engine_ == "closure" || trie.size() < separate_cost)
+      predict_batch();
+    trie.clear();
+    batch.clear();
+    separate_cost = 0;
+  }
+
+  // 残りの部分系は、負荷を均等にするため大きなものから順に割り当てる
+  vector<int> task_order;
+  for (int s = 0; s < number_of_subsystems; s++)
+    if (!is_predicted[s])
+      task_order.push_back(s);
+  int number_of_tasks = (int)task_order.size();
+  stable_sort(task_order.begin(), task_order.end(), [&](int a, int b) {
+    return subsystems[a].size() > subsystems[b].size();
+  });
+
+  atomic<int> next_task(0);
+  auto worker = [&]() {
+    vector<double> sum_of_binary_outcome, number_of_outcomes;
+    vector<uint64_t> encodings;
+    vector<int> cumulative_outcomes, used_slots;
+    vector<sparse_renyi_entry> hash_table;
+    vector<uint64_t> packed_subsystem;
+    vector<long long> pair_histogram;
+    vector<double> histogram, histogram_buffer;
+    for (int task = next_task++; task < number_of_tasks; task = next_task++) {
+      int s = task_order[task];
+      int subsystem_size = (int)subsystems[s].size();
+      string engine = engine_for(subsystem_size, number_of_shots);
+      if (engine == "closure")
+        engine = "dense"; // 量子ビットに重複がある部分系など
+      double start = profile != NULL ? wall_clock_seconds() : 0.0;
+
+      if (engine == "sparse") {
+        predicted_entropies[s] = predict_renyi_entropy_sparse(
+            subsystems[s], shots.stride(), shots.data(), number_of_shots,
+            encodings, cumulative_outcomes, hash_table, used_slots);
+        if (profile != NULL)
+          (*profile)[s] = {engine, (long long)hash_table.size(),
+                           wall_clock_seconds() - start};
+        continue;
+      }
+      if (engine == "kernel") {
+        predicted_entropies[s] = predict_renyi_entropy_kernel(
+            subsystems[s], shots.stride(), shots.data(), number_of_shots,
+            packed_subsystem, pair_histogram);
+        if (profile != NULL)
+          (*profile)[s] = {engine, (long long)pair_histogram.size(),
+                           wall_clock_seconds() - start};
+        continue;
+      }
+
+      if (engine == "histogram") {
+        predicted_entropies[s] = predict_renyi_entropy_histogram(
+            subsystems[s], shots.stride(), shots.data(), number_of_shots,
+            histogram, histogram_buffer, sum_of_binary_outcome,
+            number_of_outcomes);
+        if (profile != NULL)
+          (*profile)[s] = {engine, (long long)histogram.size(),
+                           wall_clock_seconds() - start};
+        continue;
+      }
+
+      size_t table_size = 1ULL << (2 * subsystem_size);
+      if (sum_of_binary_outcome.size() < table_size) {
+        sum_of_binary_outcome.resize(table_size);
+        number_of_outcomes.resize(table_size);
+      }
+      fill(sum_of_binary_outcome.begin(),
+           sum_of_binary_outcome.begin() + table_size, 0);
+      fill(number_of_outcomes.begin(), number_of_outcomes.begin() + table_size,
+           0);
+
+      accumulate_renyi(subsystems[s], shots.stride(), shots.data(),
+                       number_of_shots, sum_of_binary_outcome.data(),
+                       number_of_outcomes.data());
+      predicted_entropies[s] =
+          predict_renyi_entropy(subsystem_size, sum_of_binary_outcome.data(),
+                                number_of_outcomes.data());
+      if (profile != NULL)
+        (*profile)[s] = {engine, (long long)table_size,
+                         wall_clock_seconds() - start};
+    }
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < min(number_of_threads_, number_of_tasks); i++)
+    workers.push_back(thread(worker));
+  worker();
+  for (int i = 0; i < (int)workers.size(); i++)
+    workers[i].join();
+
+  return predicted_entropies;
+}
+
+dense_renyi_accumulator::dense_renyi_accumulator(const vector<int> &subsystem,
+                                                 int system_size)
+    : subsystem_(subsystem), stride_(shadow::shot_stride(system_size)) {
+  if ((int)subsystem.size() > max_dense_subsystem_size)
+    fail("密な表を使う部分系のサイズは %d 以下である必要があります。",
+         max_dense_subsystem_size);
+  for (int i = 0; i < (int)subsystem.size(); i++)
+    if (subsystem[i] < 0 || subsystem[i] >= system_size)
+      fail("部分系の量子ビット %d がシステムの範囲外です。", subsystem[i]);
+  sum_of_binary_outcome_.resize(1LL << (2 * subsystem.size()), 0);
+  number_of_outcomes_.resize(1LL << (2 * subsystem.size()), 0);
+}
+
+void dense_renyi_accumulator::add_shots(const uint64_t *shots,
+                                        long long number_of_shots) {
+  accumulate_renyi(subsystem_, stride_, shots, number_of_shots,
+                   sum_of_binary_outcome_.data(), number_of_outcomes_.data());
+}
+
+double dense_renyi_accumulator::entropy() const {
+  return predict_renyi_entropy((int)subsystem_.size(),
+                               sum_of_binary_outcome_.data(),
+                               number_of_outcomes_.data());
+}
+
+//
+// 以下のクラスは --threads N のための固定数のワーカースレッドです。
+// run(number_of_tasks, task) は task(0), ..., task(number_of_tasks - 1) を
+// 呼び出し元のスレッドとワーカースレッドで分担して実行し、
+// すべてのタスクが終わるまで戻りません。
+//
+class worker_pool {
+public:
+  explicit worker_pool(int number_of_threads)
+      : current_task(NULL), number_of_tasks(0), next_task(0),
+        unfinished_workers(0), generation(0), stopping(false) {
+    for (int i = 1; i < number_of_threads; i++)
+      workers.push_back(thread(&worker_pool::work, this));
+  }
+
+  ~worker_pool() {
+    {
+      lock_guard<mutex> lock(pool_mutex);
+      stopping = true;
+    }
+    wake_up.notify_all();
+    for (int i = 0; i < (int)workers.size(); i++)
+      workers[i].join();
+  }
+
+  void run(int tasks, const function<void(int)> &task) {
+    if (workers.empty() || tasks <= 1) {
+      for (int k = 0; k < tasks; k++)
+        task(k);
+      return;
+    }
+    {
+      lock_guard<mutex> lock(pool_mutex);
+      current_task = &task;
+      number_of_tasks = tasks;
+      next_task = 0;
+      unfinished_workers = (int)workers.size();
+      generation++;
+    }
+    wake_up.notify_all();
+    execute_tasks();
+
+    unique_lock<mutex> lock(pool_mutex);
+    all_done.wait(lock, [this]() { return unfinished_workers == 0; });
+  }
+
+private:
+  void execute_tasks() {
+    for (int k = next_task++; k < number_of_tasks; k = next_task++)
+      (*current_task)(k);
+  }
+
+  void work() {
+    long long seen_generation = 0;
+    for (;;) {
+      {
+        unique_lock<mutex> lock(pool_mutex);
+        wake_up.wait(lock, [&]() {
+          return stopping || generation != seen_generation;
+        });
+        if (stopping)
+          return;
+        seen_generation = generation;
+      }
+      execute_tasks();
+      {
+        lock_guard<mutex> lock(pool_mutex);
+        if (--unfinished_workers == 0)
+          all_done.notify_one();
+      }
+    }
+  }
+
+  vector<thread> workers;
+  const function<void(int)> *current_task;
+  int number_of_tasks;
+  atomic<int> next_task;
+  int unfinished_workers;
+  long long generation;
+  bool stopping;
+  mutex pool_mutex;
+  condition_variable wake_up, all_done;
+};
+
+//
+// fail_prob_pessimistic で計算された log_value の合計と個数。
+// 1 回の測定繰り返しの平均値が、次の繰り返しの shift になります。
+//
+struct log_value_statistics {
+  double sum_log_value;
+  int sum_cnt;
+};
+
+//
+// 悲観的推定による失敗確率 ("fail_prob_pessimistic") は
+//   2 * exp(log_value / weight - shift),
+//   log_value = -eta / 2 * cur_num_of_measurements + log1ppow1o3k[k]
+// です。以下の関数は指数 log_value / weight - shift を返し、log_value / weight
+// を statistics に加えます。係数 factor には 2 を設定しますが、既に十分な回数
+// (threshold = floor(weight * 測定回数)) 測定された観測量と、指数が -708 より
+// 小さく exp が double の正規化数の範囲を下回る場合は 0 を設定します。
+// 指数は fail_prob_from_exponents が扱える範囲 [-708, 709] に収められます。
+//
+inline double fail_prob_pessimistic_exponent(
+    int cur_num_of_measurements, int how_many_pauli_to_match, double weight,
+    double threshold, double shift, double eta, const double *log1ppow1o3k,
+    double &factor, log_value_statistics &statistics) {
+  factor = 0.0;
+  if (threshold <= cur_num_of_measurements)
+    return 0.0;
+
+  double log1pp0 =
+      (how_many_pauli_to_match < INF ? log1ppow1o3k[how_many_pauli_to_match]
+                                     : 0.0);
+  double log_value = -eta / 2 * cur_num_of_measurements + log1pp0;
+  statistics.sum_log_value += (log_value / weight);
+  statistics.sum_cnt++;
+
+  double exponent = (log_value / weight) - shift;
+  if (exponent < -708.0)
+    return 0.0;
+  factor = 2.0;
+  return min(exponent, 709.0);
+}
+
+//
+// 以下の関数は fail_prob[j] = factor[j] * exp(exponent[j]) を連続した配列に
+// ついてまとめて計算します (exponent[j] は [-708, 709] の範囲)。
+// exp は 2^k * e^r (|r| <= log(2) / 2) に分解し、e^r を 13 次の多項式で
+// 近似します (誤差は 1 ulp 程度)。分岐のないループなので、コンパイラに
+// よって SIMD 命令にベクトル化されます。
+//
+void fail_prob_from_exponents(const double *exponent, const double *factor,
+                              int count, double *fail_prob) {
+  const double log2e = 1.44269504088896338700e+00;
+  const double ln2_hi = 6.93147180369123816490e-01; // 下位ビットが 0
+  const double ln2_lo = 1.90821492927058770002e-10;
+  const double round_to_integer = 6755399441055744.0; // 1.5 * 2^52
+
+  for (int j = 0; j < count; j++) {
+    double x = exponent[j];
+
+    // k = round(x / log(2)) は kd の仮数部の下位ビットに入る
+    double kd = x * log2e + round_to_integer;
+    double k = kd - round_to_integer;
+    double r = (x - k * ln2_hi) - k * ln2_lo;
+
+    double p = 1.0 / 6227020800.0;
+    p = p * r + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+
+    // 2^k を掛ける (指数部に k を足す)
+    uint64_t k_bits, p_bits;
+    memcpy(&k_bits, &kd, sizeof(double));
+    memcpy(&p_bits, &p, sizeof(double));
+    p_bits += k_bits << 52;
+    memcpy(&p, &p_bits, sizeof(double));
+
+    fail_prob[j] = factor[j] * p;
+  }
+}
+
+//
+// 決定的な並列リダクション:
+//   観測量についての和は長さ reduction_block_size のブロックに分けて計算し、
+//   ブロックごとの部分和をブロックの順に足し合わせます。ブロックの分け方は
+//   スレッド数によらないので、出力される測定スキームはスレッド数によらず
+//   同一です。
+//
+const int reduction_block_size = 4096;
+
+// ブロックごとの exp の入出力 (スレッドごとの作業領域)
+thread_local double block_exponents[2 * reduction_block_size];
+thread_local double block_factors[2 * reduction_block_size];
+thread_local double block_fail_probs[2 * reduction_block_size];
+
+//
+// 以下の関数は測定繰り返しの初めに失敗確率の表を作ります。表の行は
+// アクティブな観測量の cur_num_of_measurements の範囲だけで、要素の数が
+// アクティブな観測量の数 (表がなければ観測量ごとに少なくとも 2 回 exp を
+// 計算します) を超える場合は作らずに false を返します。
+// 表の値は観測量ごとに計算する場合とまったく同じ式で求めるので、
+// 生成されるスキームは表を使うかどうかによりません。
+//
+const int max_weight_classes = 16;
+
+bool scheme_generator::fill_fail_prob_table(double shift) {
+  if (weight_class_.empty() || active_observables_.empty())
+    return false;
+  int min_cur = INF, max_cur = -1;
+  for (int i : active_observables_) {
+    min_cur = min(min_cur, cur_num_of_measurements_[i]);
+    max_cur = max(max_cur, cur_num_of_measurements_[i]);
+  }
+  int number_of_columns = max_k_local_ + 2;
+  long long number_of_entries = (long long)class_weight_.size() *
+                                (max_cur - min_cur + 1) * number_of_columns;
+  if (number_of_entries > (long long)active_observables_.size())
+    return false;
+
+  table_min_cur_ = min_cur;
+  table_number_of_curs_ = max_cur - min_cur + 1;
+  table_log_value_.resize(number_of_entries);
+  table_fail_prob_.resize(number_of_entries);
+  vector<double> exponents(number_of_entries), factors(number_of_entries);
+  size_t entry = 0;
+  for (int c = 0; c < (int)class_weight_.size(); c++) {
+    for (int cur = min_cur; cur <= max_cur; cur++) {
+      for (int h = 0; h < number_of_columns; h++, entry++) {
+        log_value_statistics statistics = {0.0, 0};
+        exponents[entry] = fail_prob_pessimistic_exponent(
+            cur, h <= max_k_local_ ? h : INF, class_weight_[c],
+            class_threshold_[c], shift, eta_, log1ppow1o3k_.data(),
+            factors[entry], statistics);
+        table_log_value_[entry] = statistics.sum_log_value;
+      }
+    }
+  }
+  fail_prob_from_exponents(exponents.data(), factors.data(),
+                           (int)number_of_entries, table_fail_prob_.data());
+  number_of_fail_prob_evaluations_ += number_of_entries;
+  return true;
+}
+
+struct scoring_block_result {
+  double prob_of_failure[3];
+  log_value_statistics statistics;
+  int number_of_evaluations;
+};
+
+//
+// 以下の関数は、ブロックに分けられたリスト list
+// (ブロック b の要素は list[block_begin[b] .. block_begin[b + 1])) から
+// keep(x) が偽の要素を取り除き、順序とブロックの分け方を保ったまま詰めます。
+//
+template <class Keep>
+void compact_blocks(vector<int> &list, vector<int> &block_begin, Keep keep) {
+  int number_of_blocks = (int)block_begin.size() - 1;
+  int write = 0;
+  int read = block_begin[0];
+  for (int block = 0; block < number_of_blocks; block++) {
+    int read_end = block_begin[block + 1];
+    block_begin[block] = write;
+    for (; read < read_end; read++) {
+      if (keep(list[read]))
+        list[write++] = list[read];
+    }
+  }
+  block_begin[number_of_blocks] = write;
+  list.resize(write);
+}
+
+//
+// 非ランダム化された測定スキームの生成
+//
+scheme_generator::scheme_generator(const observable_set &observables,
+                                   int measurements_per_observable,
+                                   int number_of_threads, double eta)
+    : system_size_(observables.system_size()),
+      number_of_observables_(observables.size()), eta_(eta),
+      max_k_local_(observables.max_k_local()), table_min_cur_(0),
+      table_number_of_curs_(0), success_(0),
+      sum_log_value_(0.0), sum_cnt_(0), number_of_fail_prob_evaluations_(0),
+      pool_(NULL) {
+  if (system_size_ <= 0 || observables.max_qubit() >= system_size_)
+    fail("観測量が作用する量子ビット %d がシステムサイズ %d を超えています。",
+         observables.max_qubit(), system_size_);
+
+  //
+  // 非ランダム化プロセスの効率的な使用のためにいくつかの定数を事前計算
+  //
+  double expm1eta = expm1(-eta / 2); // expm1eta = e^(-eta / 2) - 1
+  for (int k = 0; k < observables.max_k_local() + 1; k++) {
+    log1ppow1o3k_.push_back(log1p(pow(1.0 / 3.0, k) * expm1eta));
+  }
+
+  //
+  // 観測量ごとの状態は観測量のインデックスで引く連続した配列
+  // (structure of arrays) に置きます。
+  //
+  int M = number_of_observables_;
+  k_local_.resize(M);
+  weight_.resize(M);
+  threshold_.resize(M);
+  for (int i = 0; i < M; i++) {
+    k_local_[i] = observables.k_local(i);
+    weight_[i] = observables.weight(i);
+    threshold_[i] = floor(weight_[i] * measurements_per_observable);
+  }
+
+  // 重みの種類 (多すぎる場合は失敗確率の表を使わない)
+  weight_class_.resize(M);
+  for (int i = 0; i < M && !weight_class_.empty(); i++) {
+    int c = (int)(find(class_weight_.begin(), class_weight_.end(),
+                       weight_[i]) -
+                  class_weight_.begin());
+    if (c == (int)class_weight_.size()) {
+      if (c == max_weight_classes) {
+        weight_class_.clear();
+        class_weight_.clear();
+        class_threshold_.clear();
+        break;
+      }
+      class_weight_.push_back(weight_[i]);
+      class_threshold_.push_back(threshold_[i]);
+    }
+    weight_class_[i] = c;
+  }
+  cur_num_of_measurements_.assign(M, 0);
+  how_many_pauli_to_match_.assign(M, 0);
+  fail_prob_current_.assign(M, 0);
+  fail_prob_mismatch_.assign(M, 0);
+  fail_prob_matched_.assign(M, 0);
+
+  //
+  // 量子ビットとパウリごとの観測量のインデックスを計数ソートで作る
+  // (各リストの中では観測量のインデックスは昇順に並ぶ)。
+  // ある量子ビットの X, Y, Z のリストは連続しています。
+  //
+  const vector<pair<int, int>> &factors = observables.factors();
+  acting_offset_.assign(3 * system_size_ + 1, 0);
+  for (int f = 0; f < (int)factors.size(); f++)
+    acting_offset_[3 * factors[f].first + factors[f].second + 1]++;
+  for (int list = 0; list < 3 * system_size_; list++)
+    acting_offset_[list + 1] += acting_offset_[list];
+  acting_.resize(factors.size());
+  vector<int> fill_position(acting_offset_.begin(), acting_offset_.end() - 1);
+  for (int i = 0; i < M; i++) {
+    for (int f = observables.offset(i); f < observables.offset(i + 1); f++)
+      acting_[fill_position[3 * factors[f].first + factors[f].second]++] = i;
+  }
+
+  //
+  // 必要な回数だけ測定された観測量の失敗確率は常に 0 なので、
+  // 測定繰り返しごとにアクティブな (まだ測定が足りない) 観測量だけを残す。
+  //   active_observables_: アクティブな観測量のインデックス (昇順)
+  //   active_entries_: acting_ のうちアクティブな観測量を指す位置 (昇順)
+  // どちらもリダクションのブロック (観測量のインデックス、または量子ビット
+  // ごとの X, Y, Z のリストをつなげたものの中での位置を reduction_block_size
+  // で割ったもの) ごとに区切って持つので、ブロックごとの部分和は
+  // 取り除く前と同じ項を同じ順に足したものになります。
+  //
+  int number_of_observable_blocks =
+      (M + reduction_block_size - 1) / reduction_block_size;
+  active_observables_.resize(M);
+  observable_block_begin_.resize(number_of_observable_blocks + 1);
+  for (int i = 0; i < M; i++)
+    active_observables_[i] = i;
+  for (int block = 0; block <= number_of_observable_blocks; block++)
+    observable_block_begin_[block] = min(M, block * reduction_block_size);
+
+  // 量子ビット ith_qubit のブロックは
+  // [qubit_block_offset_[ith_qubit], qubit_block_offset_[ith_qubit + 1])
+  qubit_block_offset_.assign(system_size_ + 1, 0);
+  for (int ith_qubit = 0; ith_qubit < system_size_; ith_qubit++) {
+    int total_length =
+        acting_offset_[3 * ith_qubit + 3] - acting_offset_[3 * ith_qubit];
+    qubit_block_offset_[ith_qubit + 1] =
+        qubit_block_offset_[ith_qubit] +
+        (total_length + reduction_block_size - 1) / reduction_block_size;
+  }
+  active_entries_.resize(acting_.size());
+  entry_block_begin_.resize(qubit_block_offset_[system_size_] + 1);
+  for (int e = 0; e < (int)active_entries_.size(); e++)
+    active_entries_[e] = e;
+  for (int ith_qubit = 0; ith_qubit < system_size_; ith_qubit++) {
+    for (int block = qubit_block_offset_[ith_qubit];
+         block < qubit_block_offset_[ith_qubit + 1]; block++)
+      entry_block_begin_[block] =
+          acting_offset_[3 * ith_qubit] +
+          (block - qubit_block_offset_[ith_qubit]) * reduction_block_size;
+  }
+  entry_block_begin_[qubit_block_offset_[system_size_]] =
+      (int)active_entries_.size();
+
+  count_satisfied_and_retire();
+  pool_ = new worker_pool(max(1, number_of_threads));
+}
+
+scheme_generator::~scheme_generator() { delete pool_; }
+
+//
+// 以下の関数は必要な回数に達したアクティブな観測量を数えて
+// アクティブな集合から取り除きます。
+//
+void scheme_generator::count_satisfied_and_retire() {
+  const int *cur = cur_num_of_measurements_.data();
+  const double *threshold = threshold_.data();
+  auto is_active = [&](int i) { return cur[i] < threshold[i]; };
+
+  int number_of_active = (int)active_observables_.size();
+  compact_blocks(active_observables_, observable_block_begin_, is_active);
+  success_ += number_of_active - (int)active_observables_.size();
+  compact_blocks(active_entries_, entry_block_begin_,
+                 [&](int e) { return is_active(acting_[e]); });
+}
+
+//
+// 以下の関数は既存のスキームの 1 行 bases で測定される観測量の
+// 測定回数を 1 ずつ増やします。
+//
+void scheme_generator::replay(const vector<int> &bases) {
+  if ((int)bases.size() != system_size_)
+    fail("測定スキームの行は %d 個のパウリ基底でなければなりません。",
+         system_size_);
+
+  for (int i : active_observables_)
+    how_many_pauli_to_match_[i] = k_local_[i];
+  for (int ith_qubit = 0; ith_qubit < system_size_; ith_qubit++) {
+    int y_begin = acting_offset_[3 * ith_qubit + 1];
+    int z_begin = acting_offset_[3 * ith_qubit + 2];
+    const int *block_begin =
+        &entry_block_begin_[qubit_block_offset_[ith_qubit]];
+    int number_of_blocks =
+        qubit_block_offset_[ith_qubit + 1] - qubit_block_offset_[ith_qubit];
+    for (int a = block_begin[0]; a < block_begin[number_of_blocks]; a++) {
+      int e = active_entries_[a];
+      int i = acting_[e];
+      int pauli = (e >= y_begin) + (e >= z_begin);
+      if (pauli == bases[ith_qubit]) {
+        if (how_many_pauli_to_match_[i] != INF)
+          how_many_pauli_to_match_[i] -= 1;
+      } else {
+        how_many_pauli_to_match_[i] = INF;
+      }
+    }
+  }
+  for (int i : active_observables_) {
+    if (how_many_pauli_to_match_[i] == 0)
+      cur_num_of_measurements_[i]++;
+  }
+  count_satisfied_and_retire();
+}
+
+//
+// 以下の関数は乗法重み更新 (multiplicative weight update) 法で
+// 1 回分の測定繰り返しを選びます。
+//
+// ランダムに選ぶ代わりに、未測定の観測量を効率的にカバーできるような
+// パウリ基底を決定論的に (貪欲法的に) 選択します。
+//
+void scheme_generator::next(vector<int> &bases) {
+  bases.assign(system_size_, 0);
+
+  const int *acting = acting_.data();
+  const int *cur = cur_num_of_measurements_.data();
+  const int *how_many = how_many_pauli_to_match_.data();
+  const double *weight = weight_.data();
+  const double *threshold = threshold_.data();
+  const double *log1ppow1o3k = log1ppow1o3k_.data();
+  double eta = eta_;
+  int number_of_observable_blocks = (int)observable_block_begin_.size() - 1;
+
+  for (int i : active_observables_)
+    how_many_pauli_to_match_[i] =
+        k_local_[i]; // k-local 観測量の場合は k で初期化
+
+  double shift = (sum_cnt_ == 0) ? 0 : sum_log_value_ / sum_cnt_;
+  sum_log_value_ = 0.0;
+  sum_cnt_ = 0;
+
+  // 失敗確率の表が使える場合、観測量 i の値は表の行
+  // table_row(i) の列 how_many_pauli_to_match (INF の場合は最後の列)
+  bool use_table = fill_fail_prob_table(shift);
+  const double *table_log_value = table_log_value_.data();
+  const double *table_fail_prob = table_fail_prob_.data();
+  const int *weight_class = weight_class_.data();
+  int table_columns = max_k_local_ + 2;
+  auto table_row = [&](int i) {
+    return (size_t)(weight_class[i] * table_number_of_curs_ + cur[i] -
+                    table_min_cur_) *
+           table_columns;
+  };
+
+  // すべての観測量について、悲観的推定による失敗確率のキャッシュ
+  //   fail_prob_current: 現在の how_many_pauli_to_match での値
+  //   fail_prob_mismatch: いずれかのパウリが一致しなかった (INF) 場合の値
+  //   fail_prob_matched: 現在の量子ビットでパウリが一致した場合の値
+  // fail_prob_current と fail_prob_mismatch は cur_num_of_measurements と
+  // shift が変わらない間 (1 回の測定繰り返しの間) は、how_many_pauli_to_match
+  // が変わった観測量だけを更新すればよく、3 つの候補の間で再利用できます。
+  vector<log_value_statistics> observable_block_statistics(
+      number_of_observable_blocks);
+  pool_->run(number_of_observable_blocks, [&](int block) {
+    log_value_statistics &block_statistics = observable_block_statistics[block];
+    block_statistics.sum_log_value = 0.0;
+    block_statistics.sum_cnt = 0;
+    const int *block_observables =
+        active_observables_.data() + observable_block_begin_[block];
+    int block_length =
+        observable_block_begin_[block + 1] - observable_block_begin_[block];
+
+    if (use_table) {
+      for (int a = 0; a < block_length; a++) {
+        int i = block_observables[a];
+        size_t current = table_row(i) + how_many[i];
+        size_t mismatch = table_row(i) + table_columns - 1;
+        block_statistics.sum_log_value += table_log_value[current];
+        block_statistics.sum_log_value += table_log_value[mismatch];
+        block_statistics.sum_cnt += 2;
+        fail_prob_current_[i] = table_fail_prob[current];
+        fail_prob_mismatch_[i] = table_fail_prob[mismatch];
+      }
+      return;
+    }
+
+    // 指数部分を (current, mismatch) の順に並べてからまとめて exp を取る
+    double *exponents = block_exponents;
+    double *factors = block_factors;
+    double *fail_probs = block_fail_probs;
+    int count = 0;
+    for (int a = 0; a < block_length; a++) {
+      int i = block_observables[a];
+      exponents[count] = fail_prob_pessimistic_exponent(
+          cur[i], how_many[i], weight[i], threshold[i], shift, eta,
+          log1ppow1o3k, factors[count], block_statistics);
+      count++;
+      exponents[count] = fail_prob_pessimistic_exponent(
+          cur[i], INF, weight[i], threshold[i], shift, eta, log1ppow1o3k,
+          factors[count], block_statistics);
+      count++;
+    }
+    fail_prob_from_exponents(exponents, factors, count, fail_probs);
+    for (int a = 0; a < block_length; a++) {
+      int i = block_observables[a];
+      fail_prob_current_[i] = fail_probs[2 * a];
+      fail_prob_mismatch_[i] = fail_probs[2 * a + 1];
+    }
+  });
+  for (int block = 0; block < number_of_observable_blocks; block++) {
+    sum_log_value_ += observable_block_statistics[block].sum_log_value;
+    sum_cnt_ += observable_block_statistics[block].sum_cnt;
+  }
+  if (!use_table)
+    number_of_fail_prob_evaluations_ += 2LL * active_observables_.size();
+
+  vector<scoring_block_result> scoring_block_results;
+  for (int ith_qubit = 0; ith_qubit < system_size_; ith_qubit++) {
+    // X, Y, または Z を選ぶための失敗確率
+    double prob_of_failure[3] = {0, 0, 0};
+    double smallest_prob_of_failure = -1;
+
+    //
+    // 現在の繰り返しで ith_qubit に対してパウリ測定を選ぶ場合
+    //
+    // すべてのパウリ観測量 p について、スコアを計算できる。
+    // X, Y, Z のリストをつなげたもののアクティブな部分をブロックごとに
+    // 並列に処理する。位置 e のパウリは Y, Z のリストの開始位置と
+    // 比べれば分かる。
+    const int *block_begin =
+        &entry_block_begin_[qubit_block_offset_[ith_qubit]];
+    int number_of_blocks =
+        qubit_block_offset_[ith_qubit + 1] - qubit_block_offset_[ith_qubit];
+    int y_begin = acting_offset_[3 * ith_qubit + 1];
+    int z_begin = acting_offset_[3 * ith_qubit + 2];
+    scoring_block_results.resize(number_of_blocks);
+
+    pool_->run(number_of_blocks, [&](int block) {
+      scoring_block_result &result = scoring_block_results[block];
+      result.statistics.sum_log_value = 0.0;
+      result.statistics.sum_cnt = 0;
+
+      const int *entries = active_entries_.data() + block_begin[block];
+      int block_length = block_begin[block + 1] - block_begin[block];
+      for (int pauli = 0; pauli < 3; pauli++)
+        result.prob_of_failure[pauli] = 0;
+
+      if (use_table) {
+        result.number_of_evaluations = 0;
+        for (int a = 0; a < block_length; a++) {
+          int e = entries[a];
+          int i = acting[e];
+          int p = (e >= y_begin) + (e >= z_begin);
+          double mismatch = fail_prob_mismatch_[i];
+          double current = fail_prob_current_[i];
+          double match = mismatch;
+          if (how_many[i] != INF) {
+            size_t matched = table_row(i) + how_many[i] - 1;
+            result.statistics.sum_log_value += table_log_value[matched];
+            result.statistics.sum_cnt++;
+            match = table_fail_prob[matched];
+          }
+          fail_prob_matched_[i] = match;
+          for (int pauli = 0; pauli < 3; pauli++) {
+            if (pauli == p)
+              result.prob_of_failure[pauli] += match - current;
+            else
+              result.prob_of_failure[pauli] += mismatch - current;
+          }
+        }
+        return;
+      }
+
+      // まだ一致し得る観測量について、一致した場合の失敗確率をまとめて計算
+      double *exponents = block_exponents;
+      double *factors = block_factors;
+      double *matched = block_fail_probs;
+      int count = 0;
+      for (int a = 0; a < block_length; a++) {
+        int i = acting[entries[a]];
+        if (how_many[i] != INF) {
+          exponents[count] = fail_prob_pessimistic_exponent(
+              cur[i], how_many[i] - 1, weight[i], threshold[i], shift, eta,
+              log1ppow1o3k, factors[count], result.statistics);
+          count++;
+        }
+      }
+      fail_prob_from_exponents(exponents, factors, count, matched);
+      result.number_of_evaluations = count;
+
+      count = 0;
+      for (int a = 0; a < block_length; a++) {
+        int e = entries[a];
+        int i = acting[e];
+        int p = (e >= y_begin) + (e >= z_begin);
+        double mismatch = fail_prob_mismatch_[i];
+        double current = fail_prob_current_[i];
+        double match = how_many[i] == INF ? mismatch : matched[count++];
+        fail_prob_matched_[i] = match;
+        for (int pauli = 0; pauli < 3; pauli++) {
+          if (pauli == p)
+            result.prob_of_failure[pauli] += match - current;
+          else
+            result.prob_of_failure[pauli] += mismatch - current;
+        }
+      }
+    });
+
+    for (int block = 0; block < number_of_blocks; block++) {
+      for (int pauli = 0; pauli < 3; pauli++)
+        prob_of_failure[pauli] +=
+            scoring_block_results[block].prob_of_failure[pauli];
+      sum_log_value_ += scoring_block_results[block].statistics.sum_log_value;
+      sum_cnt_ += scoring_block_results[block].statistics.sum_cnt;
+      number_of_fail_prob_evaluations_ +=
+          scoring_block_results[block].number_of_evaluations;
+    }
+
+    for (int pauli = 0; pauli < 3; pauli++) {
+      if (smallest_prob_of_failure == -1)
+        smallest_prob_of_failure = prob_of_failure[pauli];
+      else
+        smallest_prob_of_failure =
+            min(smallest_prob_of_failure, prob_of_failure[pauli]);
+    }
+
+    // 最も低い失敗確率を持つものを選ぶ
+    int the_best_pauli = 0;
+    for (int pauli = 0; pauli < 3; pauli++) {
+      if (smallest_prob_of_failure == prob_of_failure[pauli]) {
+        the_best_pauli = pauli;
+        break;
+      }
+    }
+    bases[ith_qubit] = the_best_pauli;
+
+    for (int a = block_begin[0]; a < block_begin[number_of_blocks]; a++) {
+      int e = active_entries_[a];
+      int i = acting[e];
+      int pauli = (e >= y_begin) + (e >= z_begin);
+      if (the_best_pauli == pauli) {
+        if (how_many_pauli_to_match_[i] != INF)
+          how_many_pauli_to_match_[i] -= 1;
+        fail_prob_current_[i] = fail_prob_matched_[i];
+      } else {
+        how_many_pauli_to_match_[i] = INF;
+        fail_prob_current_[i] = fail_prob_mismatch_[i];
+      }
+    }
+  }
+
+  //
+  // アクティブな観測量の測定回数を更新し、必要な回数に達した観測量を
+  // 数えてアクティブな集合から取り除く
+  //
+  pool_->run(number_of_observable_blocks, [&](int block) {
+    for (int a = observable_block_begin_[block];
+         a < observable_block_begin_[block + 1]; a++) {
+      int i = active_observables_[a];
+      if (how_many_pauli_to_match_[i] == 0)
+        cur_num_of_measurements_[i]++;
+    }
+  });
+  count_satisfied_and_retire();
+}
+
+//
+// 乱数生成器 (xoshiro256**)
+//
+inline uint64_t rotate_left(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+random_generator::random_generator(uint64_t seed) {
+  // splitmix64
+  for (int i = 0; i < 4; i++) {
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    state_[i] = z ^ (z >> 31);
+  }
+}
+
+uint64_t random_generator::next() {
+  uint64_t result = rotate_left(state_[1] * 5, 7) * 9;
+  uint64_t t = state_[1] << 17;
+  state_[2] ^= state_[0];
+  state_[3] ^= state_[1];
+  state_[1] ^= state_[2];
+  state_[0] ^= state_[3];
+  state_[2] ^= t;
+  state_[3] = rotate_left(state_[3], 45);
+  return result;
+}
+
+void random_generator::jump() {
+  static const uint64_t jump_polynomial[4] = {
+      0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL,
+      0x39ABDC4529B1661CULL};
+  uint64_t jumped[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 4; i++)
+    for (int b = 0; b < 64; b++) {
+      if ((jump_polynomial[i] >> b) & 1)
+        for (int j = 0; j < 4; j++)
+          jumped[j] ^= state_[j];
+      next();
+    }
+  for (int j = 0; j < 4; j++)
+    state_[j] = jumped[j];
+}
+
+void random_generator::uniform_trits(int count, int *trits) {
+  int written = 0;
+  while (written < count) {
+    uint64_t random = next();
+    for (int byte = 0; byte < 8 && written < count; byte++, random >>= 8) {
+      int digits = (int)(random & 0xFF);
+      if (digits >= 243)
+        continue; // 3^5 = 243 以上は捨てる
+      for (int d = 0; d < 5 && written < count; d++, digits /= 3)
+        trits[written++] = digits % 3;
+    }
+  }
+}
+
+void random_bases(random_generator &generator, int system_size,
+                  vector<int> &bases) {
+  bases.resize(system_size);
+  generator.uniform_trits(system_size, bases.data());
+}
+
+void write_random_scheme(FILE *output, uint64_t seed, long long number_of_rows,
+                         int system_size, int number_of_threads) {
+  if (system_size <= 0)
+    fail("システムサイズ %d は無効です。", system_size);
+  number_of_threads = max(1, number_of_threads);
+  long long number_of_blocks =
+      (number_of_rows + random_scheme_block_rows - 1) /
+      random_scheme_block_rows;
+
+  // 1 回に number_of_threads * 2 個のブロックを並列に作り、順番に書き出す
+  int blocks_per_round = 2 * number_of_threads;
+  worker_pool pool(number_of_threads);
+  random_generator generator(seed);
+  vector<random_generator> block_generators;
+  vector<string> block_texts(blocks_per_round);
+  for (long long first_block = 0; first_block < number_of_blocks;
+       first_block += blocks_per_round) {
+    int number_of_round_blocks =
+        (int)min((long long)blocks_per_round, number_of_blocks - first_block);
+    block_generators.assign(number_of_round_blocks, generator);
+    for (int k = 0; k < number_of_round_blocks; k++) {
+      block_generators[k] = generator;
+      generator.jump();
+    }
+
+    pool.run(number_of_round_blocks, [&](int k) {
+      long long first_row = (first_block + k) * random_scheme_block_rows;
+      int rows = (int)min((long long)random_scheme_block_rows,
+                          number_of_rows - first_row);
+      static const char pauli_text[3][2] = {{'X', ' '}, {'Y', ' '}, {'Z', ' '}};
+      string &text = block_texts[k];
+      text.resize((size_t)rows * (2 * system_size + 1));
+      vector<int> trits(system_size);
+      char *p = &text[0];
+      for (int row = 0; row < rows; row++) {
+        block_generators[k].uniform_trits(system_size, trits.data());
+        for (int ith_qubit = 0; ith_qubit < system_size; ith_qubit++) {
+          memcpy(p, pauli_text[trits[ith_qubit]], 2);
+          p += 2;
+        }
+        *p++ = '\n';
+      }
+    });
+
+    for (int k = 0; k < number_of_round_blocks; k++)
+      if (fwrite(block_texts[k].data(), 1, block_texts[k].size(), output) !=
+          block_texts[k].size())
+        fail("測定スキームの書き込みに失敗しました。");
+  }
+}
+
+vector<vector<int>> read_scheme(const string &scheme_file_name,
+                                int system_size) {
+  ifstream scheme_fstream;
+  scheme_fstream.open(scheme_file_name.c_str(), ifstream::in);
+
+  if (scheme_fstream.fail())
+    fail("入力ファイル \"%s\" が存在しません。", scheme_file_name.c_str());
+
+  vector<vector<int>> scheme;
+  string line;
+  while (getline(scheme_fstream, line)) {
+    if (line.find_first_not_of(" \t\r") == string::npos)
+      continue; // 空行
+
+    istringstream single_line_stream(line);
+    string pauli_observable;
+    vector<int> bases;
+    bool valid_row = true;
+    while (single_line_stream >> pauli_observable) {
+      if ((int)bases.size() == system_size ||
+          (pauli_observable != "X" && pauli_observable != "Y" &&
+           pauli_observable != "Z")) {
+        valid_row = false;
+        break;
+      }
+      bases.push_back(pauli_observable[0] - 'X');
+    }
+    if (!valid_row || (int)bases.size() != system_size)
+      fail("\"%s\" の %d 行目は %d 個のパウリ基底 (X, Y, Z) ではありません。",
+           scheme_file_name.c_str(), (int)scheme.size() + 1, system_size);
+    scheme.push_back(bases);
+  }
+  scheme_fstream.close();
+
+  return scheme;
+}
+
+//
+// --profile のための計測
+//
+profile_report::profile_report(bool enabled)
+    : enabled_(enabled), phase_wall_start_(0), phase_cpu_start_(0) {}
+
+void profile_report::phase(const string &name) {
+  if (!enabled_)
+    return;
+  finish();
+  current_phase_ = name;
+  phase_wall_start_ = wall_clock_seconds();
+  phase_cpu_start_ = cpu_clock_seconds();
+}
+
+void profile_report::finish() {
+  if (!enabled_ || current_phase_.empty())
+    return;
+  phase_names_.push_back(current_phase_);
+  phase_seconds_.push_back(make_pair(wall_clock_seconds() - phase_wall_start_,
+                                     cpu_clock_seconds() - phase_cpu_start_));
+  current_phase_.clear();
+}
+
+double profile_report::seconds_of(const string &name) const {
+  double seconds = 0;
+  for (int p = 0; p < (int)phase_names_.size(); p++)
+    if (phase_names_[p] == name)
+      seconds += phase_seconds_[p].first;
+  return seconds;
+}
+
+void profile_report::add(const string &key, double value) {
+  if (!enabled_)
+    return;
+  char text[64];
+  snprintf(text, sizeof(text), "%.10g", value);
+  values_.push_back(make_pair(key, string(text)));
+}
+
+void profile_report::add_json(const string &key, const string &json) {
+  if (!enabled_)
+    return;
+  values_.push_back(make_pair(key, json));
+}
+
+void profile_report::write(const string &file_name) const {
+  if (!enabled_)
+    return;
+  FILE *output = file_name == "-" ? stderr : fopen(file_name.c_str(), "w");
+  if (output == NULL)
+    fail("出力ファイル \"%s\" を作成できません。", file_name.c_str());
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(output, "{\n  \"phases\": [");
+  for (int p = 0; p < (int)phase_names_.size(); p++)
+    fprintf(output,
+            "%s\n    {\"name\": \"%s\", \"wall_seconds\": %.6f, "
+            "\"cpu_seconds\": %.6f}",
+            p == 0 ? "" : ",", phase_names_[p].c_str(), phase_seconds_[p].first,
+            phase_seconds_[p].second);
+  fprintf(output, "\n  ],\n");
+  for (int v = 0; v < (int)values_.size(); v++)
+    fprintf(output, "  \"%s\": %s,\n", values_[v].first.c_str(),
+            values_[v].second.c_str());
+  fprintf(output, "  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+  if (output != stderr)
+    fclose(output);
+}
+
+} // namespace shadow
@@ -0,0 +1,557 @@
+//
+// 古典シャドウ (classical shadow) のライブラリ
+//
+// データ取得 (非ランダム化された測定スキームの生成) と予測 (局所観測量と
+// Renyi エンタングルメントエントロピー) を、グローバルな状態を持たない
+// クラスとして提供します。data_acquisition_shadow と prediction_shadow は
+// このライブラリの薄いラッパーです。C から (あるいは Python の ctypes から)
+// 使う場合は shadow_c.h を参照してください。
+//
+// エラーは std::runtime_error として送出されます。
+//
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace shadow {
+
+//
+// 測定データのビットパック表現:
+//   量子ビットを 64 個ずつ 1 ワードにまとめ、各ワードについて
+//   (basis_lo, basis_hi, outcome) の 3 つの 64 ビット整数を保持します。
+//   パウリ基底 X (0), Y (1), Z (2) は 2 ビット (basis_hi, basis_lo) で表し、
+//   outcome のビットは測定結果が -1 のとき 1 になります。
+//   1 ショットは shot_stride(system_size) 個の uint64_t です。
+//
+inline int shot_stride(int system_size) {
+  return 3 * ((system_size + 63) / 64);
+}
+
+inline int shot_pauli(const uint64_t *shot, int ith_qubit) {
+  const uint64_t *word = shot + 3 * (ith_qubit >> 6);
+  int bit = ith_qubit & 63;
+  return (int)((((word[1] >> bit) & 1) << 1) | ((word[0] >> bit) & 1));
+}
+
+inline int shot_outcome(const uint64_t *shot, int ith_qubit) {
+  return ((shot[3 * (ith_qubit >> 6) + 2] >> (ith_qubit & 63)) & 1) ? -1 : 1;
+}
+
+//
+// 以下の関数は測定結果 1 行 (1 ショット, "X 1 Y -1 ...") をビットパック表現に
+// 変換し、shot (shot_stride 個の 0 で初期化されたワード) に書き込みます。
+//
+void parse_measurement_line(const std::string &line, int system_size,
+                            uint64_t *shot);
+
+//
+// パウリ観測量 (重み付き) の集合。
+// i 番目の観測量の (位置, パウリ) は
+//   factors()[offset(i) .. offset(i + 1)]
+// に格納されます (パウリは X -> 0, Y -> 1, Z -> 2)。
+//
+class observable_set {
+public:
+  explicit observable_set(int system_size = -1);
+
+  // ファイルの観測量を追加します。最初のファイルでシステムサイズが決まり、
+  // 以降のファイルのシステムサイズは同じでなければなりません。
+  // ファイルは行の境界で分割され、number_of_threads 個のスレッドで
+  // 並列に解析されます (観測量の順番はファイルの順番のままです)。
+  void read_file(const std::string &observable_file_name,
+                 int number_of_threads = 1);
+  void add(const std::vector<std::pair<int, int>> &factors,
+           double weight = 1.0);
+
+  int system_size() const { return system_size_; }
+  int size() const { return (int)weights_.size(); }
+  int max_k_local() const { return max_k_local_; }
+  int k_local(int i) const { return offsets_[i + 1] - offsets_[i]; }
+  int offset(int i) const { return offsets_[i]; }
+  double weight(int i) const { return weights_[i]; }
+  const std::vector<std::pair<int, int>> &factors() const { return factors_; }
+  int max_qubit() const { return max_qubit_; }
+
+private:
+  void append(const std::pair<int, int> *factors, int k_local, double weight);
+
+  int system_size_;
+  int max_k_local_;
+  int max_qubit_;
+  std::vector<std::pair<int, int>> factors_;
+  std::vector<int> offsets_;
+  std::vector<double> weights_;
+};
+
+//
+// 観測量の族 (generate_observables と data_acquisition_shadow -g):
+//   family は以下のいずれかです (パウリはすべて X, Y, Z を巡ります)。
+//     paper      : 論文の例 (generate_observables.cpp の元の 3 つの族)
+//                  Y i Y i+1 X j X j+1, X i X i+1 Z j Z j2, X i X i+1 Z j
+//     k-local:K  : すべての K 個の量子ビットの組の上のすべてのパウリ文字列
+//     chain:K    : 1 次元の鎖の連続する K 個の量子ビットの上のすべての
+//                  パウリ文字列
+//     grid:W     : 幅 W (高さ system_size / W) の 2 次元格子の隣接する
+//                  量子ビットの組の上のすべての 2 体のパウリ文字列
+//     pairs[:PQ] : すべての量子ビットの組 i < j の相関 P i Q j
+//                  (PQ を省略するとすべての 9 通り)
+//   generate_observable_family は各観測量の (位置, パウリ) を emit に
+//   渡します。ファイルを介さずに observable_set に追加するには
+//   add_observable_family を使います。
+//
+void generate_observable_family(
+    const std::string &family, int system_size,
+    const std::function<void(const std::vector<std::pair<int, int>> &)>
+        &emit);
+void add_observable_family(observable_set &observables,
+                           const std::string &family);
+
+//
+// 以下の関数はファイル: subsystem_file_name の部分系のリストを返します。
+// system_size が NULL でなければファイルのシステムサイズを書き込みます。
+//
+std::vector<std::vector<int>>
+read_subsystems(const std::string &subsystem_file_name,
+                int *system_size = NULL, int number_of_threads = 1);
+
+//
+// 部分系の族 (prediction_shadow -e の [subsystem.txt] の代わり):
+//   chain[:L]  : 入れ子になった鎖 {0}, {0, 1}, ..., {0, 1, ..., L - 1}
+//                (L を省略すると system_size まで)
+//   subsets:K  : 大きさ 1 から K までのすべての量子ビットの部分集合
+//                (大きさの順、同じ大きさの中では辞書順)
+//   どちらも部分集合を共有するので、閉包のエンジンでまとめて処理されます。
+//
+std::vector<std::vector<int>>
+generate_subsystem_family(const std::string &family, int system_size);
+
+//
+// ビットパックされたショットの列。
+// 自分でメモリを持つ (テキストの読み込み、append)、mmap したバイナリ
+// ファイルを指す、または呼び出し元のバッファをコピーせずに指す
+// (view) のいずれかです。view の場合、バッファは shot_batch より
+// 長く生存している必要があります。
+//
+class shot_batch {
+public:
+  explicit shot_batch(int system_size = -1);
+  shot_batch(int system_size, const uint64_t *shots,
+             long long number_of_shots); // view
+  shot_batch(const shot_batch &) = delete;
+  shot_batch &operator=(const shot_batch &) = delete;
+  shot_batch(shot_batch &&other);
+  shot_batch &operator=(shot_batch &&other);
+  ~shot_batch();
+
+  // テキスト形式またはバイナリ形式 (mmap) のファイルを読み込みます。
+  // テキスト形式は number_of_threads 個のスレッドで並列に解析されます。
+  void read_file(const std::string &measurement_file_name,
+                 int number_of_threads = 1);
+  void write_binary(const std::string &binary_file_name) const;
+  void append_line(const std::string &line);
+  void clear();
+
+  int system_size() const { return system_size_; }
+  int stride() const { return stride_; }
+  long long size() const { return number_of_shots_; }
+  // t 番目のショットは data() + t * stride() から始まる
+  const uint64_t *data() const { return data_; }
+
+private:
+  void set_system_size(int system_size);
+  bool map_binary(const std::string &measurement_file_name);
+  void release();
+
+  int system_size_;
+  int stride_;
+  long long number_of_shots_;
+  std::vector<uint64_t> packed_;
+  const uint64_t *data_;
+  void *mapped_;
+  size_t mapped_size_;
+};
+
+//
+// 測定ファイルの逐次的な読み込み:
+//   テキスト形式のファイルは行の境界で分割され、バックグラウンドの
+//   number_of_threads 個のスレッドで先読みしながら解析されます。
+//   next はショットのまとまりをファイルの順番に返すので、呼び出し元は
+//   解析と並行して推定を進められます。返されたショットは次の next の
+//   呼び出しまで有効です。バイナリ形式のファイルは mmap され、
+//   1 回の next ですべてのショットが返されます。
+//
+class measurement_reader {
+public:
+  explicit measurement_reader(const std::string &measurement_file_name,
+                              int number_of_threads = 1);
+  measurement_reader(const measurement_reader &) = delete;
+  measurement_reader &operator=(const measurement_reader &) = delete;
+  ~measurement_reader();
+
+  int system_size() const;
+  bool next(const uint64_t *&shots, long long &number_of_shots);
+
+private:
+  struct pipeline;
+  pipeline *pipeline_;
+};
+
+//
+// 観測量のトライ (prefix tree):
+//   各観測量の因子をファイルの順番に根からたどる木で、先頭の因子が同じ
+//   観測量はその部分を共有します。同じ量子ビットに作用する因子は
+//   すべてショットの基底と一致する必要があるので 1 つのノードにまとめ、
+//   pauli はそのパウリ (異なるパウリが並ぶ場合は、どの基底とも一致しない 3)
+//   です。outcome は因子の数が奇数なら 1、偶数 (測定結果が打ち消し合う)
+//   なら 0 です。
+//   ノードは前順に並び、ノード n の部分木は [n, subtree_end) です。
+//   同じ観測量 (因子の順番は問わない) は 1 つの累積値 accumulator を
+//   共有します。
+//
+struct observable_trie_node {
+  int qubit;
+  int pauli;
+  int outcome; // 測定結果をパリティに含めるなら 1
+  int depth;
+  int subtree_end;
+  int accumulator; // このノードで終わる観測量の累積値 (なければ -1)
+};
+
+//
+// 中央値平均 (median-of-means) による予測値と、その分散の推定値および
+// 95% 信頼区間 [lower, upper]。
+//
+struct median_of_means_estimate {
+  double estimate;
+  double variance;
+  double lower;
+  double upper;
+};
+
+//
+// 局所観測量の予測:
+//   add_shots でショットを (何回に分けてでも) 加え、estimate(i) で i 番目の
+//   観測量の予測値 (測定結果の平均) を得ます。加算はすべて整数で行うので、
+//   結果はスレッド数とショットの分け方によりません。
+//
+//   number_of_batches が K > 1 のとき、t 番目に加えたショットは
+//   t mod K 番目のバッチに加算され、median_of_means(i) で中央値平均を
+//   得られます。バッチは 1 回の走査で同時に集計されます。
+//
+class observable_predictor {
+public:
+  observable_predictor(const observable_set &observables, int system_size,
+                       int number_of_threads = 1, int number_of_batches = 1);
+
+  void add_shots(const uint64_t *shots, long long number_of_shots);
+  void add_shots(const shot_batch &shots);
+  void reset();
+
+  int size() const { return (int)accumulator_of_observable_.size(); }
+  int number_of_batches() const { return number_of_batches_; }
+  int number_of_measurements(int i) const;
+  int sum_of_measurement_results(int i) const;
+  // バッチ batch だけの測定回数と測定結果の合計
+  int number_of_measurements(int i, int batch) const {
+    return number_of_measurements_[accumulator_of_observable_[i] *
+                                       number_of_batches_ +
+                                   batch];
+  }
+  int sum_of_measurement_results(int i, int batch) const {
+    return sum_of_measurement_results_[accumulator_of_observable_[i] *
+                                           number_of_batches_ +
+                                       batch];
+  }
+  double estimate(int i) const; // 測定されていない観測量は 0
+  median_of_means_estimate median_of_means(int i) const;
+
+private:
+  std::vector<observable_trie_node> trie_;
+  std::vector<int> accumulator_of_observable_;
+  int stride_;
+  int number_of_threads_;
+  int number_of_batches_;
+  long long number_of_shots_added_;
+  // 累積値 a のバッチ b は a * number_of_batches_ + b 番目
+  std::vector<int> number_of_measurements_;
+  std::vector<int> sum_of_measurement_results_;
+};
+
+//
+// すべての 2 点相関 <P_i Q_j> の予測 (prediction_shadow -c):
+//   量子ビットの組 (i, j) とパウリ P, Q (X (0), Y (1), Z (2)) の
+//   n x n x 9 通りすべてについて、P_i Q_j が測定された回数と測定結果の
+//   積の合計を 1 回の走査で求めます。観測量を 1 つずつ照合する代わりに、
+//   ショットを量子ビットごと基底ごとのビット列 (ビット t が t 番目の
+//   ショット) に転置し、回数を AND の popcount として行列積の形で求めます。
+//   対角 (i = j) は P = Q のとき 1 量子ビットの <P_i> で、P != Q は
+//   測定されないものとして扱います。結果はスレッド数によらず同一です。
+//   ショットは correlation_block_shots 個ずつ転置されるので、add_shots には
+//   なるべくそれだけの数のショットをまとめて渡してください。
+//
+const int correlation_block_shots = 1 << 16;
+
+class correlation_predictor {
+public:
+  correlation_predictor(int system_size, int number_of_threads = 1);
+
+  void add_shots(const uint64_t *shots, long long number_of_shots);
+  void add_shots(const shot_batch &shots);
+
+  int system_size() const { return system_size_; }
+  // (i, P, j, Q) の累積値は index(i, P, j, Q) 番目
+  size_t index(int i, int P, int j, int Q) const {
+    return ((size_t)i * system_size_ + j) * 9 + 3 * P + Q;
+  }
+  int number_of_measurements(int i, int P, int j, int Q) const {
+    return number_of_measurements_[index(i, P, j, Q)];
+  }
+  int sum_of_measurement_results(int i, int P, int j, int Q) const {
+    return sum_of_measurement_results_[index(i, P, j, Q)];
+  }
+  double estimate(int i, int P, int j, int Q) const; // 測定されていなければ 0
+
+  // 結果を CSV (行 "i,j,XX,XY,...,ZZ") またはバイナリ形式で書き出します。
+  void write_csv(FILE *output) const;
+  void write_binary(const std::string &binary_file_name) const;
+
+private:
+  void accumulate_block(const std::vector<uint64_t> &bits,
+                        long long words_per_row);
+
+  int system_size_;
+  int stride_;
+  int number_of_threads_;
+  long long number_of_shots_added_;
+  std::vector<int> number_of_measurements_;
+  std::vector<int> sum_of_measurement_results_;
+};
+
+//
+// Renyi エンタングルメントエントロピーの予測:
+//   engine は "dense", "sparse", "kernel", "closure", "histogram", "auto" の
+//   いずれかです (prediction_shadow の --engine を参照)。closure は密な表と
+//   同じ結果を部分系の族の部分集合を共有して求め、histogram は同じ表を
+//   (基底, 測定結果) のヒストグラムの変換で求めます。
+//
+const int max_dense_subsystem_size = 13;
+const int max_sparse_subsystem_size = 32;   // encoding は 64 ビットに収める
+const int max_histogram_subsystem_size = 8; // ビンは 6^n 個
+
+// 部分系ごとの計測結果 (--profile)。table_entries は密な表の要素数、
+// 疎なエンジンのハッシュ表のスロット数、ペアのエンジンのヒストグラムの
+// ビン数、ヒストグラムのエンジンのビン数のいずれかです。
+struct renyi_subsystem_profile {
+  std::string engine;
+  long long table_entries;
+  double seconds;
+};
+
+class renyi_predictor {
+public:
+  explicit renyi_predictor(const std::string &engine = "auto",
+                           int number_of_threads = 1);
+
+  // profile が NULL でなければ、部分系ごとの計測結果を書き込みます。
+  std::vector<double>
+  predict(const std::vector<std::vector<int>> &subsystems,
+          const shot_batch &shots,
+          std::vector<renyi_subsystem_profile> *profile = NULL) const;
+  std::string engine_for(int subsystem_size, long long number_of_shots) const;
+
+private:
+  std::string engine_;
+  int number_of_threads_;
+};
+
+//
+// 1 つの部分系の密な表 (4^n 個) にショットを逐次加え、いつでも
+// エントロピーを予測できるようにしたもの (ストリーミング用)。
+//
+class dense_renyi_accumulator {
+public:
+  dense_renyi_accumulator(const std::vector<int> &subsystem, int system_size);
+
+  void add_shots(const uint64_t *shots, long long number_of_shots);
+  double entropy() const;
+
+private:
+  std::vector<int> subsystem_;
+  int stride_;
+  std::vector<double> sum_of_binary_outcome_;
+  std::vector<double> number_of_outcomes_;
+};
+
+//
+// 非ランダム化された測定スキームの生成 (乗法重み更新法):
+//   next(bases) を呼ぶたびに 1 回分の測定繰り返し (量子ビットごとの
+//   パウリ基底 X (0), Y (1), Z (2)) を生成します。finished() はすべての
+//   観測量が必要な回数 floor(weight * measurements_per_observable) だけ
+//   測定されたかどうかを返します。replay(bases) は既存のスキームの 1 行を
+//   測定回数に数えます。
+//   スコアの和は固定のブロックに分けて計算するので、生成されるスキームは
+//   スレッド数によりません。
+//
+class worker_pool;
+
+class scheme_generator {
+public:
+  scheme_generator(const observable_set &observables,
+                   int measurements_per_observable, int number_of_threads = 1,
+                   double eta = 0.9);
+  scheme_generator(const scheme_generator &) = delete;
+  scheme_generator &operator=(const scheme_generator &) = delete;
+  ~scheme_generator();
+
+  void replay(const std::vector<int> &bases);
+  void next(std::vector<int> &bases);
+  bool finished() const { return success_ == number_of_observables_; }
+  int number_of_satisfied() const { return success_; }
+  int system_size() const { return system_size_; }
+  // これまでに計算した悲観的推定による失敗確率の数
+  long long number_of_fail_prob_evaluations() const {
+    return number_of_fail_prob_evaluations_;
+  }
+
+private:
+  void count_satisfied_and_retire();
+  bool fill_fail_prob_table(double shift);
+
+  int system_size_;
+  int number_of_observables_;
+  double eta_;
+  std::vector<int> k_local_;
+  std::vector<double> weight_;
+  std::vector<double> threshold_; // floor(weight * measurements_per_observable)
+  std::vector<double> log1ppow1o3k_;
+
+  // 失敗確率の表: 重みの種類が max_weight_classes 個以下なら、失敗確率は
+  // (重みの種類, cur_num_of_measurements, how_many_pauli_to_match) だけで
+  // 決まるので、測定繰り返しごとに表にして観測量の間で共有します。
+  // 行 (種類 c, 測定回数 cur) の列 h (0 <= h <= max_k_local_) は
+  // how_many_pauli_to_match = h、列 max_k_local_ + 1 は INF の値です。
+  std::vector<int> weight_class_; // 種類が多すぎる場合は空
+  std::vector<double> class_weight_;
+  std::vector<double> class_threshold_;
+  int max_k_local_;
+  int table_min_cur_;
+  int table_number_of_curs_;
+  std::vector<double> table_log_value_; // log_value / weight
+  std::vector<double> table_fail_prob_;
+
+  // ith_qubit に X (0), Y (1), Z (2) を適用する観測量のインデックスは
+  //   acting_[acting_offset_[3 * ith_qubit + pauli] ..
+  //           acting_offset_[3 * ith_qubit + pauli + 1]]
+  std::vector<int> acting_;
+  std::vector<int> acting_offset_;
+
+  // 観測量ごとの状態 (structure of arrays)
+  std::vector<int> cur_num_of_measurements_;
+  std::vector<int> how_many_pauli_to_match_;
+  std::vector<double> fail_prob_current_;
+  std::vector<double> fail_prob_mismatch_;
+  std::vector<double> fail_prob_matched_;
+
+  // アクティブな (まだ測定が足りない) 観測量と、それを指す acting_ の位置
+  std::vector<int> active_observables_;
+  std::vector<int> observable_block_begin_;
+  std::vector<int> active_entries_;
+  std::vector<int> entry_block_begin_;
+  std::vector<int> qubit_block_offset_;
+
+  int success_;
+  double sum_log_value_;
+  int sum_cnt_;
+  long long number_of_fail_prob_evaluations_;
+  worker_pool *pool_;
+};
+
+//
+// 乱数生成器 xoshiro256** (https://prng.di.unimi.it/)。
+// シードは splitmix64 で 256 ビットの状態に広げます。jump() は next() を
+// 2^128 回呼んだのと同じだけ状態を進めるので、jump() で区切った列は
+// 互いに重なりません。
+//
+class random_generator {
+public:
+  explicit random_generator(uint64_t seed);
+
+  uint64_t next();
+  void jump();
+  // 一様ランダムな 0, 1, 2 を count 個 trits に書き込みます。8 ビットの
+  // 乱数のうち 243 (= 3^5) 未満のものだけを 5 個の 3 進数の桁として使う
+  // ので、偏りはありません。
+  void uniform_trits(int count, int *trits);
+
+private:
+  uint64_t state_[4];
+};
+
+//
+// 以下の関数は古典シャドウのランダム化バージョンの 1 回分の測定繰り返し
+// (一様ランダムなパウリ基底 X (0), Y (1), Z (2)) を bases に書き込みます。
+//
+void random_bases(random_generator &generator, int system_size,
+                  std::vector<int> &bases);
+
+//
+// 以下の関数はランダム化された測定スキーム (number_of_rows 行) を
+// テキスト形式で output に書き出します。行は random_scheme_block_rows 行
+// ずつのブロックに分けられ、ブロック b はシード seed の生成器を b 回
+// jump() したもので作られます。ブロックは number_of_threads 個の
+// スレッドで並列に作られますが、出力はシードだけで決まります。
+//
+const int random_scheme_block_rows = 1024;
+void write_random_scheme(FILE *output, uint64_t seed, long long number_of_rows,
+                         int system_size, int number_of_threads = 1);
+
+//
+// 以下の関数は測定スキームのファイル (data_acquisition_shadow -d の出力) を
+// 読み込み、各行のパウリ基底 X (0), Y (1), Z (2) を返します。
+//
+std::vector<std::vector<int>> read_scheme(const std::string &scheme_file_name,
+                                          int system_size);
+
+//
+// --profile のための計測:
+//   phase(name) で始めた区間は次の phase() か finish() で終わり、区間ごとの
+//   経過時間 (wall) と CPU 時間 (すべてのスレッドの合計) が記録されます。
+//   add() は任意の数値や JSON の値を記録し、write() は最大使用メモリと
+//   ともに JSON として書き出します。無効な場合はどのメソッドも何もしません。
+//
+double wall_clock_seconds(); // 経過時間 (秒)
+double cpu_clock_seconds();  // プロセスの CPU 時間 (すべてのスレッドの合計, 秒)
+
+class profile_report {
+public:
+  explicit profile_report(bool enabled = false);
+
+  bool enabled() const { return enabled_; }
+  void phase(const std::string &name);
+  void finish();
+  double seconds_of(const std::string &name) const; // 区間の経過時間
+  void add(const std::string &key, double value);
+  void add_json(const std::string &key, const std::string &json);
+  // file_name が "-" の場合は標準エラー出力に書き出します。
+  void write(const std::string &file_name) const;
+
+private:
+  bool enabled_;
+  std::string current_phase_;
+  double phase_wall_start_;
+  double phase_cpu_start_;
+  std::vector<std::string> phase_names_;
+  std::vector<std::pair<double, double>> phase_seconds_; // (wall, cpu)
+  std::vector<std::pair<std::string, std::string>> values_;
+};
+
+} // namespace shadow
+
+#endif // SHADOW_H
@@ -0,0 +1,256 @@
+//
+// 古典シャドウのライブラリの C インターフェース (shadow_c.h) の実装です。
+// 例外はここで捕まえて、メッセージを shadow_last_error() に保存します。
+//
+#include "shadow_c.h"
+#include "shadow.h"
+
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+struct shadow_observable_set {
+  shadow::observable_set observables;
+};
+
+struct shadow_shot_batch {
+  shadow::shot_batch shots;
+};
+
+struct shadow_observable_predictor {
+  shadow::observable_predictor predictor;
+};
+
+struct shadow_scheme_generator {
+  shadow::scheme_generator generator;
+};
+
+namespace {
+
+thread_local string last_error;
+
+//
+// 以下の関数は body() を実行し、成功すれば 0 を、例外が送出されれば
+// そのメッセージを last_error に保存して -1 を返します。
+//
+template <class Body> int guarded(Body body) {
+  try {
+    body();
+    return 0;
+  } catch (const exception &error) {
+    last_error = error.what();
+  } catch (...) {
+    last_error = "不明なエラーです。";
+  }
+  return -1;
+}
+
+} // namespace
+
+extern "C" {
+
+const char *shadow_last_error(void) { return last_error.c_str(); }
+
+shadow_observable_set *shadow_observable_set_create(int system_size) {
+  shadow_observable_set *handle = NULL;
+  guarded([&]() {
+    handle = new shadow_observable_set{shadow::observable_set(system_size)};
+  });
+  return handle;
+}
+
+shadow_observable_set *shadow_observable_set_read(const char *file_name) {
+  shadow_observable_set *handle = NULL;
+  guarded([&]() {
+    shadow::observable_set observables;
+    observables.read_file(file_name);
+    handle = new shadow_observable_set{std::move(observables)};
+  });
+  return handle;
+}
+
+int shadow_observable_set_add(shadow_observable_set *observables, int k_local,
+                              const int *qubits, const int *paulis,
+                              double weight) {
+  return guarded([&]() {
+    vector<pair<int, int>> factors;
+    for (int k = 0; k < k_local; k++)
+      factors.push_back(make_pair(qubits[k], paulis[k]));
+    observables->observables.add(factors, weight);
+  });
+}
+
+int shadow_observable_set_size(const shadow_observable_set *observables) {
+  return observables->observables.size();
+}
+
+void shadow_observable_set_free(shadow_observable_set *observables) {
+  delete observables;
+}
+
+int shadow_shot_stride(int system_size) {
+  return shadow::shot_stride(system_size);
+}
+
+shadow_shot_batch *shadow_shot_batch_read(const char *file_name) {
+  shadow_shot_batch *handle = NULL;
+  guarded([&]() {
+    shadow::shot_batch shots;
+    shots.read_file(file_name);
+    handle = new shadow_shot_batch{std::move(shots)};
+  });
+  return handle;
+}
+
+shadow_shot_batch *shadow_shot_batch_wrap(int system_size,
+                                          const uint64_t *shots,
+                                          long long number_of_shots) {
+  shadow_shot_batch *handle = NULL;
+  guarded([&]() {
+    handle = new shadow_shot_batch{
+        shadow::shot_batch(system_size, shots, number_of_shots)};
+  });
+  return handle;
+}
+
+long long shadow_shot_batch_size(const shadow_shot_batch *shots) {
+  return shots->shots.size();
+}
+
+int shadow_shot_batch_write_binary(const shadow_shot_batch *shots,
+                                   const char *file_name) {
+  return guarded([&]() { shots->shots.write_binary(file_name); });
+}
+
+void shadow_shot_batch_free(shadow_shot_batch *shots) { delete shots; }
+
+int shadow_pack_shots(int system_size, long long number_of_shots,
+                      const int *bases, const int *outcomes, uint64_t *packed) {
+  return guarded([&]() {
+    int stride = shadow::shot_stride(system_size);
+    for (long long t = 0; t < number_of_shots; t++) {
+      uint64_t *shot = packed + t * stride;
+      for (int j = 0; j < stride; j++)
+        shot[j] = 0;
+      for (int ith_qubit = 0; ith_qubit < system_size; ith_qubit++) {
+        int pauli = bases[t * system_size + ith_qubit];
+        int outcome = outcomes[t * system_size + ith_qubit];
+        if (pauli < 0 || pauli > 2 || (outcome != 1 && outcome != -1))
+          throw runtime_error("パウリ基底は 0, 1, 2、測定結果は 1 または -1 "
+                              "である必要があります。");
+        uint64_t *word = shot + 3 * (ith_qubit >> 6);
+        uint64_t bit = 1ULL << (ith_qubit & 63);
+        if (pauli & 1)
+          word[0] |= bit;
+        if (pauli & 2)
+          word[1] |= bit;
+        if (outcome == -1)
+          word[2] |= bit;
+      }
+    }
+  });
+}
+
+shadow_observable_predictor *
+shadow_observable_predictor_create(const shadow_observable_set *observables,
+                                   int system_size, int number_of_threads) {
+  shadow_observable_predictor *handle = NULL;
+  guarded([&]() {
+    handle = new shadow_observable_predictor{shadow::observable_predictor(
+        observables->observables, system_size, number_of_threads)};
+  });
+  return handle;
+}
+
+int shadow_observable_predictor_add_shots(
+    shadow_observable_predictor *predictor, const shadow_shot_batch *shots) {
+  return guarded([&]() { predictor->predictor.add_shots(shots->shots); });
+}
+
+int shadow_observable_predictor_add_packed(
+    shadow_observable_predictor *predictor, const uint64_t *shots,
+    long long number_of_shots) {
+  return guarded(
+      [&]() { predictor->predictor.add_shots(shots, number_of_shots); });
+}
+
+int shadow_observable_predictor_estimates(
+    const shadow_observable_predictor *predictor, double *estimates) {
+  return guarded([&]() {
+    for (int i = 0; i < predictor->predictor.size(); i++)
+      estimates[i] = predictor->predictor.estimate(i);
+  });
+}
+
+void shadow_observable_predictor_free(shadow_observable_predictor *predictor) {
+  delete predictor;
+}
+
+int shadow_predict_renyi_entropies(const shadow_shot_batch *shots,
+                                   int number_of_subsystems,
+                                   const int *offsets, const int *qubits,
+                                   const char *engine, int number_of_threads,
+                                   double *entropies) {
+  return guarded([&]() {
+    vector<vector<int>> subsystems(number_of_subsystems);
+    for (int s = 0; s < number_of_subsystems; s++)
+      subsystems[s].assign(qubits + offsets[s], qubits + offsets[s + 1]);
+    shadow::renyi_predictor predictor(engine == NULL ? "auto" : engine,
+                                      number_of_threads);
+    vector<double> predicted_entropies =
+        predictor.predict(subsystems, shots->shots);
+    for (int s = 0; s < number_of_subsystems; s++)
+      entropies[s] = predicted_entropies[s];
+  });
+}
+
+shadow_scheme_generator *
+shadow_scheme_generator_create(const shadow_observable_set *observables,
+                               int measurements_per_observable,
+                               int number_of_threads) {
+  shadow_scheme_generator *handle = NULL;
+  guarded([&]() {
+    handle = new shadow_scheme_generator{
+        {observables->observables, measurements_per_observable,
+         number_of_threads}};
+  });
+  return handle;
+}
+
+int shadow_scheme_generator_replay(shadow_scheme_generator *generator,
+                                   const int *bases) {
+  return guarded([&]() {
+    int system_size = generator->generator.system_size();
+    generator->generator.replay(vector<int>(bases, bases + system_size));
+  });
+}
+
+int shadow_scheme_generator_next(shadow_scheme_generator *generator,
+                                 int *bases) {
+  return guarded([&]() {
+    vector<int> next_bases;
+    generator->generator.next(next_bases);
+    for (int ith_qubit = 0; ith_qubit < (int)next_bases.size(); ith_qubit++)
+      bases[ith_qubit] = next_bases[ith_qubit];
+  });
+}
+
+int shadow_scheme_generator_finished(const shadow_scheme_generator *generator) {
+  return generator->generator.finished() ? 1 : 0;
+}
+
+int shadow_scheme_generator_number_of_satisfied(
+    const shadow_scheme_generator *generator) {
+  return generator->generator.number_of_satisfied();
+}
+
+void shadow_scheme_generator_free(shadow_scheme_generator *generator) {
+  delete generator;
+}
+
+} // extern "C"
@@ -0,0 +1,108 @@
+/*
+ * 古典シャドウのライブラリ (shadow.h) の C インターフェース
+ *
+ * C や Python の ctypes などから使うための、例外を送出しない薄い
+ * ラッパーです。オブジェクトは不透明なハンドルとして扱い、*_free で
+ * 解放します。
+ *
+ * int を返す関数は成功すると 0 を、失敗すると -1 を返します。ハンドルを
+ * 返す関数は失敗すると NULL を返します。失敗の理由は shadow_last_error()
+ * で取得できます (呼び出したスレッドごとに保持されます)。
+ *
+ * パウリ基底は X -> 0, Y -> 1, Z -> 2 で表します。ショットは
+ * ビットパック表現 (shadow.h を参照) で、1 ショットは
+ * shadow_shot_stride(system_size) 個の uint64_t です。
+ */
+#ifndef SHADOW_C_H
+#define SHADOW_C_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct shadow_observable_set shadow_observable_set;
+typedef struct shadow_shot_batch shadow_shot_batch;
+typedef struct shadow_observable_predictor shadow_observable_predictor;
+typedef struct shadow_scheme_generator shadow_scheme_generator;
+
+const char *shadow_last_error(void);
+
+/* 観測量の集合 */
+shadow_observable_set *shadow_observable_set_create(int system_size);
+shadow_observable_set *shadow_observable_set_read(const char *file_name);
+/* qubits[k] に paulis[k] が作用する k 局所観測量を追加します。 */
+int shadow_observable_set_add(shadow_observable_set *observables, int k_local,
+                              const int *qubits, const int *paulis,
+                              double weight);
+int shadow_observable_set_size(const shadow_observable_set *observables);
+void shadow_observable_set_free(shadow_observable_set *observables);
+
+/* ショットの列 */
+int shadow_shot_stride(int system_size);
+shadow_shot_batch *shadow_shot_batch_read(const char *file_name);
+/* shots をコピーせずに指します。shots はハンドルより長く生存すること。 */
+shadow_shot_batch *shadow_shot_batch_wrap(int system_size,
+                                          const uint64_t *shots,
+                                          long long number_of_shots);
+long long shadow_shot_batch_size(const shadow_shot_batch *shots);
+int shadow_shot_batch_write_binary(const shadow_shot_batch *shots,
+                                   const char *file_name);
+void shadow_shot_batch_free(shadow_shot_batch *shots);
+
+/*
+ * number_of_shots 個のショット (ショット t の量子ビット q の基底は
+ * bases[t * system_size + q]、測定結果 (+1 または -1) は
+ * outcomes[t * system_size + q]) をビットパックして packed
+ * (number_of_shots * shadow_shot_stride(system_size) 個) に書き込みます。
+ */
+int shadow_pack_shots(int system_size, long long number_of_shots,
+                      const int *bases, const int *outcomes, uint64_t *packed);
+
+/* 局所観測量の予測 */
+shadow_observable_predictor *
+shadow_observable_predictor_create(const shadow_observable_set *observables,
+                                   int system_size, int number_of_threads);
+int shadow_observable_predictor_add_shots(
+    shadow_observable_predictor *predictor, const shadow_shot_batch *shots);
+int shadow_observable_predictor_add_packed(
+    shadow_observable_predictor *predictor, const uint64_t *shots,
+    long long number_of_shots);
+/* estimates には観測量の数だけの要素が必要です。 */
+int shadow_observable_predictor_estimates(
+    const shadow_observable_predictor *predictor, double *estimates);
+void shadow_observable_predictor_free(shadow_observable_predictor *predictor);
+
+/*
+ * Renyi エンタングルメントエントロピーの予測。
+ * s 番目の部分系の量子ビットは qubits[offsets[s] .. offsets[s + 1]) です。
+ * engine は "dense", "sparse", "kernel", "closure", "histogram", "auto" の
+ * いずれかです。
+ */
+int shadow_predict_renyi_entropies(const shadow_shot_batch *shots,
+                                   int number_of_subsystems,
+                                   const int *offsets, const int *qubits,
+                                   const char *engine, int number_of_threads,
+                                   double *entropies);
+
+/* 非ランダム化された測定スキームの生成 */
+shadow_scheme_generator *
+shadow_scheme_generator_create(const shadow_observable_set *observables,
+                               int measurements_per_observable,
+                               int number_of_threads);
+/* bases には system_size 個の要素が必要です。 */
+int shadow_scheme_generator_replay(shadow_scheme_generator *generator,
+                                   const int *bases);
+int shadow_scheme_generator_next(shadow_scheme_generator *generator,
+                                 int *bases);
+int shadow_scheme_generator_finished(const shadow_scheme_generator *generator);
+int shadow_scheme_generator_number_of_satisfied(
+    const shadow_scheme_generator *generator);
+void shadow_scheme_generator_free(shadow_scheme_generator *generator);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHADOW_C_H */
@@ -0,0 +1,14 @@
+# Runs
+#   ${PROGRAM} -o ${MEASUREMENT} ${OBSERVABLES}
+# and compares its standard output with the file ${EXPECTED}.
+execute_process(
+  COMMAND ${PROGRAM} -o ${MEASUREMENT} ${OBSERVABLES}
+  OUTPUT_VARIABLE output
+  RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${PROGRAM} exited with ${result}")
+endif()
+file(READ ${EXPECTED} expected)
+if(NOT output STREQUAL expected)
+  message(FATAL_ERROR "Output differs from ${EXPECTED}:\n${output}")
+endif()